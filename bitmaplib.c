@@ -1628,13 +1628,12 @@ int JPEG_Write(FILE *fptr,BITMAP4 *image,int width,int height,int quality)
 
 /*
    Get dimensions of a JPEG image
+   Only the header is read, the output size is worked out without decoding
 */
 int JPEG_Info(FILE *fptr,int *width,int *height,int *depth)
 {
-   int row_stride;
    struct jpeg_decompress_struct cinfo;
    struct jpeg_error_mgr jerr;
-   JSAMPARRAY buffer;   
 
    // Error handler
    cinfo.err = jpeg_std_error(&jerr);
@@ -1644,20 +1643,12 @@ int JPEG_Info(FILE *fptr,int *width,int *height,int *depth)
 
    // Read header
    jpeg_read_header(&cinfo, TRUE);
-
-   // Read one scan line
-   jpeg_start_decompress(&cinfo);
-   row_stride = cinfo.output_width * cinfo.output_components;
-   buffer = (*cinfo.mem->alloc_sarray)
-      ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
-   while (cinfo.output_scanline < cinfo.output_height) 
-      jpeg_read_scanlines(&cinfo,(JSAMPARRAY)buffer,1);
+   jpeg_calc_output_dimensions(&cinfo);
 
    *width = cinfo.output_width;
    *height = cinfo.output_height;
    *depth = 8*cinfo.output_components;
 
-   jpeg_finish_decompress(&cinfo);
    jpeg_destroy_decompress(&cinfo);
 
    rewind(fptr);
@@ -1665,16 +1656,21 @@ int JPEG_Info(FILE *fptr,int *width,int *height,int *depth)
    return(TRUE);
 }
 
+#define JPEG_ROWS 16 // Scanlines handed to libjpeg at a time
+
 /*
-   Read a JPEG image
+   Read a JPEG image, the bottom scanline is stored first
+   With libjpeg-turbo the scanlines are decoded as RGBA, alpha 255, straight
+   into their rows of image, the row pointers give the bottom up order.
+   Otherwise they are decoded to a row buffer and copied across.
 */
 int JPEG_Read(FILE *fptr,BITMAP4 *image,int *width,int *height)
 {
-   int i,j;
-   int row_stride;
+   int i,j,n;
    struct jpeg_decompress_struct cinfo;
    struct jpeg_error_mgr jerr;
-   JSAMPLE *buffer;
+   JSAMPROW row[JPEG_ROWS];
+   JSAMPLE *buffer = NULL;
 
    // Error handler
    cinfo.err = jpeg_std_error(&jerr);
@@ -1684,19 +1680,41 @@ int JPEG_Read(FILE *fptr,BITMAP4 *image,int *width,int *height)
 
    // Read header
    jpeg_read_header(&cinfo, TRUE);
+#ifdef JCS_EXTENSIONS
+   if (cinfo.out_color_space == JCS_RGB)
+      cinfo.out_color_space = JCS_EXT_RGBA;
+#endif
    jpeg_start_decompress(&cinfo);
 
    *width = cinfo.output_width;
    *height = cinfo.output_height;
 
-   // Can only handle RGB JPEG images at this stage
-   if (cinfo.output_components != 3) 
+   // Decoded in place
+#ifdef JCS_EXTENSIONS
+   if (cinfo.out_color_space == JCS_EXT_RGBA) {
+      while (cinfo.output_scanline < cinfo.output_height) {
+         n = MIN(JPEG_ROWS,cinfo.output_height-cinfo.output_scanline);
+         for (j=0;j<n;j++)
+            row[j] = (JSAMPROW)(image + (cinfo.output_height-1-cinfo.output_scanline-j) * (size_t)cinfo.output_width);
+         jpeg_read_scanlines(&cinfo,row,n);
+      }
+      jpeg_finish_decompress(&cinfo);
+      jpeg_destroy_decompress(&cinfo);
+      return(0);
+   }
+#endif
+
+   // Can only handle RGB JPEG images at this stage, not greyscale or CMYK
+   if (cinfo.out_color_space != JCS_RGB || cinfo.output_components != 3) {
+      jpeg_destroy_decompress(&cinfo);
       return(1);
+   }
 
    // buffer for one scan line
-   row_stride = cinfo.output_width * cinfo.output_components;
-   if ((buffer = malloc(row_stride * sizeof(JSAMPLE))) == NULL) 
+   if ((buffer = malloc(cinfo.output_width * 3 * sizeof(JSAMPLE))) == NULL) {
+      jpeg_destroy_decompress(&cinfo);
       return(2);
+   }
 
    j = cinfo.output_height-1;
    while (cinfo.output_scanline < cinfo.output_height) {
@@ -1717,6 +1735,487 @@ int JPEG_Read(FILE *fptr,BITMAP4 *image,int *width,int *height)
 
    return(0);
 }
+
+/*
+   libjpeg error handler, keeps the message and returns to the setjmp() in
+   JPEG_Decode() or JPEG_Encode() instead of exiting
+*/
+static void JPEG_ErrorExit(j_common_ptr cinfo)
+{
+   JPEGERROR *err = (JPEGERROR *)cinfo->err;
+
+   (*cinfo->err->format_message)(cinfo,err->message);
+   longjmp(err->jump,1);
+}
+
+/*
+   Create a decoder for JPEG_Decode(), NULL if out of memory
+   The libjpeg object, its memory and the buffers are reused for every image
+*/
+JPEGDECODER *JPEG_NewDecoder(void)
+{
+   JPEGDECODER *dec;
+
+   if ((dec = calloc(1,sizeof(JPEGDECODER))) == NULL)
+      return(NULL);
+   dec->cinfo.err = jpeg_std_error(&dec->err.pub);
+   dec->err.pub.error_exit = JPEG_ErrorExit;
+   if (setjmp(dec->err.jump)) {
+      free(dec);
+      return(NULL);
+   }
+   jpeg_create_decompress(&dec->cinfo);
+
+   return(dec);
+}
+
+/*
+   Read the whole file fname into the decoder's buffer, grown as needed
+   Return the file size, 0 on failure with the reason in dec->err.message
+*/
+static long JPEG_LoadFile(JPEGDECODER *dec,char *fname)
+{
+   long size;
+   FILE *fptr;
+
+   if ((fptr = fopen(fname,"rb")) == NULL) {
+      sprintf(dec->err.message,"Failed to open file");
+      return(0);
+   }
+   if (fseek(fptr,0,SEEK_END) != 0 || (size = ftell(fptr)) <= 0) {
+      sprintf(dec->err.message,"Failed to read file");
+      fclose(fptr);
+      return(0);
+   }
+   rewind(fptr);
+   if (size > dec->nalloc) {
+      free(dec->data);
+      if ((dec->data = malloc(size)) == NULL) {
+         dec->nalloc = 0;
+         sprintf(dec->err.message,"Out of memory");
+         fclose(fptr);
+         return(0);
+      }
+      dec->nalloc = size;
+   }
+   if (fread(dec->data,1,size,fptr) != size) {
+      sprintf(dec->err.message,"Failed to read file");
+      fclose(fptr);
+      return(0);
+   }
+   fclose(fptr);
+
+   return(size);
+}
+
+/*
+   Dimensions of the JPEG file fname from its header, for sizing the image
+   given to JPEG_Decode(). Return FALSE on failure, reason in dec->err.message
+*/
+int JPEG_DecodeSize(JPEGDECODER *dec,char *fname,int *width,int *height)
+{
+   long size;
+   struct jpeg_decompress_struct *cinfo = &dec->cinfo;
+
+   dec->err.message[0] = '\0';
+   if ((size = JPEG_LoadFile(dec,fname)) <= 0)
+      return(FALSE);
+
+   if (setjmp(dec->err.jump)) {
+      jpeg_abort_decompress(cinfo);
+      return(FALSE);
+   }
+   jpeg_mem_src(cinfo,dec->data,size);
+   jpeg_read_header(cinfo,TRUE);
+   *width = cinfo->image_width;
+   *height = cinfo->image_height;
+   jpeg_abort_decompress(cinfo);
+
+   return(TRUE);
+}
+
+/*
+   Read the JPEG file fname into image, bottom scanline first as JPEG_Read()
+   With scale of 2, 4 or 8 the image is reduced by that much in the DCT
+   domain as it is decoded, which is much faster than decoding full size.
+   The decoded image must be width by height, the file is read whole into
+   the decoder's buffer and closed before decoding. Return FALSE on failure,
+   the reason is in dec->err.message, the decoder can still be used.
+*/
+int JPEG_Decode(JPEGDECODER *dec,char *fname,BITMAP4 *image,int width,int height,int scale)
+{
+   int i,j,n,inplace;
+   long size;
+   JSAMPROW row[JPEG_ROWS];
+   struct jpeg_decompress_struct *cinfo = &dec->cinfo;
+
+   dec->err.message[0] = '\0';
+   if ((size = JPEG_LoadFile(dec,fname)) <= 0)
+      return(FALSE);
+
+   if (setjmp(dec->err.jump)) {
+      jpeg_abort_decompress(cinfo);
+      return(FALSE);
+   }
+   jpeg_mem_src(cinfo,dec->data,size);
+   jpeg_read_header(cinfo,TRUE);
+#ifdef JCS_EXTENSIONS
+   if (cinfo->out_color_space == JCS_RGB)
+      cinfo->out_color_space = JCS_EXT_RGBA;
+#endif
+   cinfo->scale_num = 1;
+   cinfo->scale_denom = scale;
+   jpeg_calc_output_dimensions(cinfo);
+   inplace = FALSE;
+#ifdef JCS_EXTENSIONS
+   inplace = (cinfo->out_color_space == JCS_EXT_RGBA);
+#endif
+   if (!inplace && (cinfo->out_color_space != JCS_RGB || cinfo->output_components != 3)) {
+      sprintf(dec->err.message,"Not an RGB image");
+      jpeg_abort_decompress(cinfo);
+      return(FALSE);
+   }
+   if (cinfo->output_width != width || cinfo->output_height != height) {
+      sprintf(dec->err.message,"Expected a %d x %d RGB image",width,height);
+      jpeg_abort_decompress(cinfo);
+      return(FALSE);
+   }
+   if (!inplace && dec->nbuffer < width) {
+      free(dec->buffer);
+      if ((dec->buffer = malloc(3*width*sizeof(JSAMPLE))) == NULL) {
+         dec->nbuffer = 0;
+         sprintf(dec->err.message,"Out of memory");
+         jpeg_abort_decompress(cinfo);
+         return(FALSE);
+      }
+      dec->nbuffer = width;
+   }
+   jpeg_start_decompress(cinfo);
+
+   while (cinfo->output_scanline < height) {
+      j = height - 1 - cinfo->output_scanline;
+
+      // Decoded in place, see JPEG_Read()
+      if (inplace) {
+         n = MIN(JPEG_ROWS,height-cinfo->output_scanline);
+         for (i=0;i<n;i++)
+            row[i] = (JSAMPROW)(image + (j - i) * (size_t)width);
+         jpeg_read_scanlines(cinfo,row,n);
+         continue;
+      }
+
+      jpeg_read_scanlines(cinfo,&dec->buffer,1);
+      for (i=0;i<width;i++) {
+         image[j*(size_t)width+i].r = dec->buffer[3*i];
+         image[j*(size_t)width+i].g = dec->buffer[3*i+1];
+         image[j*(size_t)width+i].b = dec->buffer[3*i+2];
+         image[j*(size_t)width+i].a = 255;
+      }
+   }
+   jpeg_finish_decompress(cinfo);
+
+   return(TRUE);
+}
+
+void JPEG_FreeDecoder(JPEGDECODER *dec)
+{
+   if (dec == NULL)
+      return;
+   jpeg_destroy_decompress(&dec->cinfo);
+   free(dec->data);
+   free(dec->buffer);
+   free(dec);
+}
+
+/*
+   Create an encoder for JPEG_Encode(), NULL if out of memory
+*/
+JPEGENCODER *JPEG_NewEncoder(void)
+{
+   JPEGENCODER *enc;
+
+   if ((enc = calloc(1,sizeof(JPEGENCODER))) == NULL)
+      return(NULL);
+   enc->cinfo.err = jpeg_std_error(&enc->err.pub);
+   enc->err.pub.error_exit = JPEG_ErrorExit;
+   if (setjmp(enc->err.jump)) {
+      free(enc);
+      return(NULL);
+   }
+   jpeg_create_compress(&enc->cinfo);
+   enc->subsample = JPEG_SUB420;
+   enc->dct = JDCT_ISLOW;
+
+   return(enc);
+}
+
+/*
+   libjpeg destination writing to the encoder's own buffer, grown as needed
+   The buffer always belongs to the encoder, so a failed encode leaks nothing.
+   The encoder struct starts with cinfo, so the two pointers are the same.
+*/
+static boolean JPEG_GrowBuffer(j_compress_ptr cinfo)
+{
+   unsigned long n;
+   unsigned char *data;
+   JPEGENCODER *enc = (JPEGENCODER *)cinfo;
+
+   n = MAX(2*enc->nalloc,65536);
+   if ((data = realloc(enc->data,n)) == NULL)
+      ERREXIT1(cinfo,JERR_OUT_OF_MEMORY,0);
+   enc->dest.next_output_byte = data + enc->nalloc; // Called when the buffer is full
+   enc->dest.free_in_buffer = n - enc->nalloc;
+   enc->data = data;
+   enc->nalloc = n;
+
+   return(TRUE);
+}
+
+static void JPEG_InitBuffer(j_compress_ptr cinfo)
+{
+   JPEGENCODER *enc = (JPEGENCODER *)cinfo;
+
+   if (enc->nalloc == 0) { // libjpeg writes before it checks for room
+      JPEG_GrowBuffer(cinfo);
+      return;
+   }
+   enc->dest.next_output_byte = enc->data;
+   enc->dest.free_in_buffer = enc->nalloc;
+}
+
+static void JPEG_TermBuffer(j_compress_ptr cinfo)
+{
+   JPEGENCODER *enc = (JPEGENCODER *)cinfo;
+
+   enc->size = enc->nalloc - enc->dest.free_in_buffer;
+}
+
+/*
+   Encode rows j0 to j1 of image, counted in the order they are written, to
+   fptr or with fptr NULL to the encoder's memory buffer. An encoder must only
+   ever be used for one of the two, libjpeg does not allow switching.
+   quality is 0 to 100 and negative means flip vertically.
+*/
+static int JPEG_EncodeRows(JPEGENCODER *enc,FILE *fptr,BITMAP4 *image,int width,int height,
+   int j0,int j1,int quality)
+{
+   int i,j,n,flip = FALSE;
+   JSAMPROW row[JPEG_ROWS];
+   struct jpeg_compress_struct *cinfo = &enc->cinfo;
+
+   if (quality > 0) // Historical
+      flip = TRUE;
+   quality = ABS(quality);
+
+   enc->err.message[0] = '\0';
+#ifndef JCS_EXTENSIONS
+   if (enc->nbuffer < width) {
+      free(enc->buffer);
+      if ((enc->buffer = malloc(3*width*sizeof(JSAMPLE))) == NULL) {
+         enc->nbuffer = 0;
+         sprintf(enc->err.message,"Out of memory");
+         return(FALSE);
+      }
+      enc->nbuffer = width;
+   }
+#endif
+   if (setjmp(enc->err.jump)) {
+      jpeg_abort_compress(cinfo);
+      enc->size = 0;
+      return(FALSE);
+   }
+   if (fptr != NULL) {
+      jpeg_stdio_dest(cinfo,fptr);
+   } else {
+      enc->dest.init_destination = JPEG_InitBuffer;
+      enc->dest.empty_output_buffer = JPEG_GrowBuffer;
+      enc->dest.term_destination = JPEG_TermBuffer;
+      cinfo->dest = &enc->dest;
+   }
+   cinfo->image_width = width;
+   cinfo->image_height = j1 - j0;
+#ifdef JCS_EXTENSIONS
+   cinfo->input_components = 4;
+   cinfo->in_color_space = JCS_EXT_RGBX;
+#else
+   cinfo->input_components = 3;
+   cinfo->in_color_space = JCS_RGB;
+#endif
+   jpeg_set_defaults(cinfo);
+   jpeg_set_quality(cinfo,quality,TRUE);
+   cinfo->comp_info[0].h_samp_factor = (enc->subsample == JPEG_SUB444) ? 1 : 2;
+   cinfo->comp_info[0].v_samp_factor = (enc->subsample == JPEG_SUB420) ? 2 : 1;
+   cinfo->dct_method = enc->dct;
+   jpeg_start_compress(cinfo,TRUE);
+
+   while (cinfo->next_scanline < j1 - j0) {
+      j = j0 + cinfo->next_scanline;
+#ifdef JCS_EXTENSIONS
+      n = MIN(JPEG_ROWS,j1-j);
+      for (i=0;i<n;i++)
+         row[i] = (JSAMPROW)(image + (flip ? height-1-j-i : j+i) * (size_t)width);
+#else
+      n = 1;
+      for (i=0;i<width;i++) {
+         enc->buffer[3*i  ] = image[(flip ? height-1-j : j)*(size_t)width+i].r;
+         enc->buffer[3*i+1] = image[(flip ? height-1-j : j)*(size_t)width+i].g;
+         enc->buffer[3*i+2] = image[(flip ? height-1-j : j)*(size_t)width+i].b;
+      }
+      row[0] = enc->buffer;
+#endif
+      jpeg_write_scanlines(cinfo,row,n);
+   }
+   jpeg_finish_compress(cinfo);
+
+   return(TRUE);
+}
+
+/*
+   Write image to fptr as JPEG_Write(), quality is 0 to 100 and negative
+   means flip vertically. With libjpeg-turbo the rows of image are handed to
+   libjpeg directly as RGBX, otherwise they are copied to a row buffer.
+   The subsampling and DCT method are the encoder's.
+   Return FALSE on failure, the reason is in enc->err.message.
+*/
+int JPEG_Encode(JPEGENCODER *enc,FILE *fptr,BITMAP4 *image,int width,int height,int quality)
+{
+   return(JPEG_EncodeRows(enc,fptr,image,width,height,0,height,quality));
+}
+
+/*
+   Rows in each of about nstrip strips of an image for JPEG_EncodeStrip()
+   Strips are whole MCU rows, and no more MCUs than a restart interval can
+   count, so they can be joined by JPEG_JoinStrips().
+*/
+int JPEG_StripRows(int subsample,int width,int height,int nstrip)
+{
+   int mcuwidth,mcuheight,rows;
+
+   mcuwidth = (subsample == JPEG_SUB444) ? 8 : 16;
+   mcuheight = (subsample == JPEG_SUB420) ? 16 : 8;
+   rows = (height + nstrip - 1) / nstrip;
+   rows = (rows + mcuheight - 1) / mcuheight;
+   rows = MIN(rows,65535/((width+mcuwidth-1)/mcuwidth));
+
+   return(MAX(rows,1) * mcuheight);
+}
+
+/*
+   Encode rows j0 to j1 of image, in the order they are written, as a JPEG of
+   their own in the encoder's memory buffer. Strips of all the rows, encoded
+   by one encoder each at the same quality, are joined by JPEG_JoinStrips().
+   The encoders do not share anything so the strips may be encoded at once.
+   Return FALSE on failure, the reason is in enc->err.message.
+*/
+int JPEG_EncodeStrip(JPEGENCODER *enc,BITMAP4 *image,int width,int height,int j0,int j1,int quality)
+{
+   return(JPEG_EncodeRows(enc,NULL,image,width,height,j0,j1,quality));
+}
+
+/*
+   Offsets of the frame header, the scan header and the entropy coded data
+   of a JPEG in memory, FALSE if it is not a baseline JPEG as libjpeg writes
+*/
+static int JPEG_ScanStart(unsigned char *data,unsigned long size,unsigned long *sof,
+   unsigned long *sos,unsigned long *scan)
+{
+   unsigned long i = 2;
+
+   *sof = 0;
+   if (size < 4 || data[0] != 0xff || data[1] != 0xd8 || data[size-2] != 0xff || data[size-1] != 0xd9)
+      return(FALSE);
+   while (i + 4 <= size && data[i] == 0xff) {
+      if (data[i+1] == 0xc0 || data[i+1] == 0xc1)
+         *sof = i;
+      if (data[i+1] == 0xdd) // Must not have a restart interval of its own
+         return(FALSE);
+      if (data[i+1] == 0xda) {
+         *sos = i;
+         *scan = i + 2 + (data[i+2] << 8) + data[i+3];
+         return(*sof > 0 && *scan + 2 <= size);
+      }
+      i += 2 + (data[i+2] << 8) + data[i+3];
+   }
+
+   return(FALSE);
+}
+
+/*
+   Write the nstrip strips of rows rows each, the last may be shorter, encoded
+   by JPEG_EncodeStrip() as one JPEG image. The headers are the first strip's
+   with the height of the whole image and a restart interval of one strip.
+   The entropy coded data of the strips follow each other separated by restart
+   markers. Each strip was coded with the DC predictions starting at zero and
+   padded to a whole byte, exactly as a restart interval, so the image decodes
+   to the same pixels as one encoded by JPEG_Encode().
+   Return FALSE on failure, the reason is in the first strip's err.message.
+*/
+int JPEG_JoinStrips(FILE *fptr,JPEGENCODER **strip,int nstrip,int width,int height,int rows)
+{
+   int i,mcuwidth,mcuheight,interval;
+   unsigned long sof,sos,scan;
+   unsigned char marker[6];
+   JPEGENCODER *enc = strip[0];
+
+   mcuwidth = (enc->subsample == JPEG_SUB444) ? 8 : 16;
+   mcuheight = (enc->subsample == JPEG_SUB420) ? 16 : 8;
+   interval = (rows / mcuheight) * ((width + mcuwidth - 1) / mcuwidth);
+   if (rows % mcuheight != 0 || interval > 65535) {
+      sprintf(enc->err.message,"Strips of %d rows can not be joined",rows);
+      return(FALSE);
+   }
+
+   // Headers of the first strip with the full height and the restart interval
+   if (!JPEG_ScanStart(enc->data,enc->size,&sof,&sos,&scan)) {
+      sprintf(enc->err.message,"Unexpected markers in strip");
+      return(FALSE);
+   }
+   enc->data[sof+5] = height >> 8;
+   enc->data[sof+6] = height & 0xff;
+   marker[0] = 0xff;
+   marker[1] = 0xdd;
+   marker[2] = 0;
+   marker[3] = 4;
+   marker[4] = interval >> 8;
+   marker[5] = interval & 0xff;
+   if (fwrite(enc->data,1,sos,fptr) != sos || fwrite(marker,1,6,fptr) != 6 ||
+      fwrite(enc->data+sos,1,scan-sos,fptr) != scan-sos)
+      goto failed;
+
+   // Entropy coded data of each strip, RST0 to RST7 in turn between them
+   for (i=0;i<nstrip;i++) {
+      if (i > 0) {
+         marker[1] = 0xd0 + (i - 1) % 8;
+         if (fwrite(marker,1,2,fptr) != 2)
+            goto failed;
+         if (!JPEG_ScanStart(strip[i]->data,strip[i]->size,&sof,&sos,&scan)) {
+            sprintf(enc->err.message,"Unexpected markers in strip %d",i);
+            return(FALSE);
+         }
+      }
+      if (fwrite(strip[i]->data+scan,1,strip[i]->size-2-scan,fptr) != strip[i]->size-2-scan)
+         goto failed;
+   }
+   marker[1] = 0xd9;
+   if (fwrite(marker,1,2,fptr) != 2)
+      goto failed;
+
+   return(TRUE);
+
+failed:
+   sprintf(enc->err.message,"Failed to write");
+   return(FALSE);
+}
+
+void JPEG_FreeEncoder(JPEGENCODER *enc)
+{
+   if (enc == NULL)
+      return;
+   jpeg_destroy_compress(&enc->cinfo);
+   free(enc->buffer);
+   free(enc->data);
+   free(enc);
+}
 #endif
 
 #ifdef ADDPNG
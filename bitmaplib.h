@@ -10,7 +10,9 @@
 //#define ADDEXR
 
 #ifdef ADDJPEG
+#include <setjmp.h>
 #include <jpeglib.h>
+#include <jerror.h>
 #endif
 #ifdef ADDPNG
 #include <png.h>
@@ -107,6 +109,43 @@ typedef struct {
 } COLOURINDEX;
 // *** end for BMP
 
+#ifdef ADDJPEG
+// libjpeg errors return to the caller rather than exiting
+typedef struct {
+   struct jpeg_error_mgr pub;
+   jmp_buf jump;
+   char message[JMSG_LENGTH_MAX];
+} JPEGERROR;
+
+// Decoder kept across many images, see JPEG_Decode()
+typedef struct {
+   struct jpeg_decompress_struct cinfo;
+   JPEGERROR err;
+   unsigned char *data;        // Compressed file
+   size_t nalloc;
+   JSAMPLE *buffer;            // Row buffer, only without libjpeg-turbo
+   int nbuffer;
+} JPEGDECODER;
+
+// Chroma subsampling of JPEG_Encode() and JPEG_EncodeStrip()
+#define JPEG_SUB444 0
+#define JPEG_SUB422 1
+#define JPEG_SUB420 2
+
+// Encoder kept across many images, see JPEG_Encode() and JPEG_EncodeStrip()
+typedef struct {
+   struct jpeg_compress_struct cinfo;
+   JPEGERROR err;
+   int subsample;              // JPEG_SUB420 unless changed
+   J_DCT_METHOD dct;           // JDCT_ISLOW unless changed
+   JSAMPLE *buffer;            // Row buffer, only without libjpeg-turbo
+   int nbuffer;
+   struct jpeg_destination_mgr dest;
+   unsigned char *data;        // Strip encoded in memory, see JPEG_GrowBuffer()
+   unsigned long size,nalloc;
+} JPEGENCODER;
+#endif
+
 BITMAP4 *Create_Bitmap(int,int);
 void Destroy_Bitmap(BITMAP4 *);
 void Write_Bitmap(FILE *,BITMAP4 *,int,int,int);
@@ -155,6 +194,16 @@ int IsJPEG(char *);
 int JPEG_Write(FILE *,BITMAP4 *,int,int,int);
 int JPEG_Info(FILE *,int *,int *,int *);
 int JPEG_Read(FILE *,BITMAP4 *,int *,int *);
+JPEGDECODER *JPEG_NewDecoder(void);
+int JPEG_DecodeSize(JPEGDECODER *,char *,int *,int *);
+int JPEG_Decode(JPEGDECODER *,char *,BITMAP4 *,int,int,int);
+void JPEG_FreeDecoder(JPEGDECODER *);
+JPEGENCODER *JPEG_NewEncoder(void);
+int JPEG_Encode(JPEGENCODER *,FILE *,BITMAP4 *,int,int,int);
+int JPEG_StripRows(int,int,int,int);
+int JPEG_EncodeStrip(JPEGENCODER *,BITMAP4 *,int,int,int,int,int);
+int JPEG_JoinStrips(FILE *,JPEGENCODER **,int,int,int,int);
+void JPEG_FreeEncoder(JPEGENCODER *);
 #endif
 
 #ifdef ADDPNG
@@ -22,6 +22,13 @@
 FISHEYE fisheye[2];           // Input fisheye
 PARAMS params;                // General parameters
 BITMAP4 *spherical = NULL;    // Output image
+RAYTABLE rays;                // Output supersample directions
+POLARROWS polar;              // Reduced rows towards the poles, see MakePolarRows()
+ZONES zones;                  // Single camera and blended column spans, see MakeZones()
+int filterweight[FRACONE][4]; // Tap weights for each sub pixel position, see MakeFilter()
+KERNEL kernels[MAXKERNEL];    // Kernel variants this CPU can run, see SelectKernels()
+int nkernel = 0;
+KERNEL kernel;                // The variant in use
 
 // These are known frame templates
 // The appropriate one to use will be auto detected, error is none match
@@ -30,22 +37,15 @@ BITMAP4 *spherical = NULL;    // Output image
 FRAMESPECS template[NTEMPLATE] = {{3104,3000,0,0,0,0},{2704,2624,0,0,0,0},{1568,1504,0,0,0,0}};
 int whichtemplate = -1;  
 
-// Lookup table
-typedef struct {
-   UV uv;
-} LLTABLE;
-LLTABLE *lltable = NULL;
-
-int readJPGFast(FISHEYE *fJPG)
+/*
+	Read a batch frame of camera fJPG into image with the camera's decoder,
+	reused for every frame. The frame must be the size of the first one, it is
+	decoded at 1/scale. fJPG is not changed so both cameras may be read at once.
+*/
+int readJPGFast(FISHEYE *fJPG,char *fname,BITMAP4 *image,JPEGDECODER *dec)
 {
-	FILE *fimg;
-	if ((fimg = fopen(fJPG->fname,"rb")) == NULL) {
-		fprintf(stderr,"   Failed to open image file \"%s\"\n",fJPG->fname);
-		return(FALSE);
-	}
-	//JPEG_Info(fimg, &fJPG->width, &fJPG->height,&d);
-	if (JPEG_Read(fimg, fJPG->image,&fJPG->width,&fJPG->height) != 0) {
-		fprintf(stderr,"   Failed to correctly read image \"%s\"\n",fJPG->fname);
+	if (!JPEG_Decode(dec,fname,image,fJPG->width,fJPG->height,fJPG->scale)) {
+		fprintf(stderr,"   Failed to correctly read image \"%s\", %s\n",fname,dec->err.message);
 		return(FALSE);
 	}
 	return(TRUE);
@@ -53,22 +53,91 @@ int readJPGFast(FISHEYE *fJPG)
 
 int readJPG(FISHEYE *fJPG)
 {
-	FILE *fimg;
-	int w,h,d;
-	if ((fimg = fopen(fJPG->fname,"rb")) == NULL) {
-		fprintf(stderr,"   Failed to open image file \"%s\"\n",fJPG->fname);
+	int ok = FALSE;
+	JPEGDECODER *dec;
+
+	// Decoder errors come back here, this runs on a ReadFrames() thread
+	if ((dec = JPEG_NewDecoder()) == NULL) {
+		fprintf(stderr,"   Failed to create a JPEG decoder\n");
 		return(FALSE);
 	}
-	JPEG_Info(fimg, &fJPG->width, &fJPG->height,&d);
-	fJPG->image = Create_Bitmap(fJPG->width, fJPG->height);
-	if (JPEG_Read(fimg, fJPG->image,&w,&h) != 0) {
-		fprintf(stderr,"   Failed to correctly read image \"%s\"\n",fJPG->fname);
-		return(FALSE);
+	if (!JPEG_DecodeSize(dec,fJPG->fname,&fJPG->width,&fJPG->height)) {
+		fprintf(stderr,"   Failed to read image file \"%s\", %s\n",fJPG->fname,dec->err.message);
+	} else if ((fJPG->image = Create_Bitmap(fJPG->width,fJPG->height)) == NULL) {
+		fprintf(stderr,"   Failed to allocate memory for image \"%s\"\n",fJPG->fname);
+	} else if (!JPEG_Decode(dec,fJPG->fname,fJPG->image,fJPG->width,fJPG->height,1)) {
+		fprintf(stderr,"   Failed to correctly read image \"%s\", %s\n",fJPG->fname,dec->err.message);
+	} else {
+		ok = TRUE;
 	}
-	return(TRUE);
+	JPEG_FreeDecoder(dec);
+	return(ok);
+}
+
+/*
+	Read the -f images of cameras n0 to n1, ok[n] is FALSE for a failure
+	Called with ParallelRows() so the two are read at once
+*/
+void ReadFrames(void *arg,int n0,int n1)
+{
+	int n,*ok = arg;
+
+	for (n=n0;n<n1;n++)
+		ok[n] = readJPG(&fisheye[n]);
+}
+
+/*
+	Decode cameras n0 to n1 of a pair of batch frames into the job's image
+*/
+void DecodeFrames(void *arg,int n0,int n1)
+{
+	int n;
+	FRAMEJOB *job = arg;
+	BITMAP4 *image;
+
+	for (n=n0;n<n1;n++) {
+		image = job->image + n * fisheye[0].width * (size_t)fisheye[0].height;
+		job->ok[n] = TRUE;
+		if (IsJPEG(job->fname[n]))
+			job->ok[n] = readJPGFast(&fisheye[n],job->fname[n],image,job->decoder[n]);
+	}
+}
+
+void *DecodeFramesThread(void *arg)
+{
+	ParallelRows(2,1,DecodeFrames,arg);
+	return(NULL);
+}
+
+/*
+	Start decoding frame nframe of both cameras, on a thread of its own
+	that decodes the two at once. With one thread it is left to FinishFrames().
+*/
+void StartFrames(FRAMEJOB *job,char *front,char *back,int nframe)
+{
+	sprintf(job->fname[0],front,nframe);
+	sprintf(job->fname[1],back,nframe);
+	job->running = FALSE;
+	if (params.nthreads > 1 && pthread_create(&job->thread,NULL,DecodeFramesThread,job) == 0)
+		job->running = TRUE;
+}
+
+/*
+	Wait for a pair started by StartFrames(), FALSE if either camera failed
+	The reason has been reported
+*/
+int FinishFrames(FRAMEJOB *job)
+{
+	if (job->running)
+		pthread_join(job->thread,NULL);
+	else
+		DecodeFrames(job,0,2);
+	job->running = FALSE;
+
+	return(job->ok[0] && job->ok[1]);
 }
 
-int WriteOutputImageBatch(BITMAP4 *spherical, char *basename,char *s)
+int WriteOutputImageBatch(BITMAP4 *spherical, char *basename,char *s,STRIPENCODER *enc)
 {
 	int i;
 	FILE *fptr;
@@ -92,121 +161,2256 @@ int WriteOutputImageBatch(BITMAP4 *spherical, char *basename,char *s)
       return(FALSE);
    }
 
-    JPEG_Write(fptr,spherical,params.outwidth,params.outheight,100);
+	if (!EncodeOutput(enc,fptr,spherical)) {
+		fprintf(stderr,"Failed to write \"%s\", %s\n",fname,enc->error);
+		fclose(fptr);
+		return(FALSE);
+	}
 
-    fclose(fptr);
+	if (fclose(fptr) != 0)
+		return(FALSE);
 	return(TRUE);
 }
 
 /*
-	Given a longitude and latitude calculate the rgb value from the fisheye
-	Return FALSE if the pixel is outside the fisheye image
+	Is a longitude within the range where a camera contributes to the blend
+*/
+int InBlendRange(int n,double longitude)
+{
+   if (n == 0) {
+      if (longitude > params.blendmid + params.blendwidth || longitude < -params.blendmid - params.blendwidth)
+			return(FALSE);
+	}
+   if (n == 1) {
+      if (longitude > -params.blendmid + params.blendwidth && longitude < params.blendmid - params.blendwidth)
+			return(FALSE); 
+   }
+	return(TRUE);
+}
+
+/*
+	Precompute the angles, and their sin and cos, of the supersample rows and columns
+	of the output image. Supersample js is row js/antialias, step js%antialias down it,
+	likewise for columns. Each output row shares its latitudes and each column its
+	longitudes, so per sample ray directions need no trigonometry.
+	The angles are formed exactly as the sampling loops used to form them.
+*/
+int MakeRays(void)
+{
+	int i,j,ai,aj,s;
+	double latitude0,longitude0;
+
+	rays.nlatitude = params.outheight * params.antialias;
+	rays.nlongitude = params.outwidth * params.antialias;
+	rays.latitude = malloc(3*rays.nlatitude*sizeof(double));
+	rays.longitude = malloc(3*rays.nlongitude*sizeof(double));
+	rays.fcoslongitude = malloc(2*rays.nlongitude*sizeof(float));
+	if (rays.latitude == NULL || rays.longitude == NULL || rays.fcoslongitude == NULL)
+		return(FALSE);
+	rays.fsinlongitude = rays.fcoslongitude + rays.nlongitude;
+	rays.coslatitude = rays.latitude + rays.nlatitude;
+	rays.sinlatitude = rays.coslatitude + rays.nlatitude;
+	rays.coslongitude = rays.longitude + rays.nlongitude;
+	rays.sinlongitude = rays.coslongitude + rays.nlongitude;
+
+	for (j=0;j<params.outheight;j++) {
+		latitude0 = PI * j / (double)params.outheight - PID2; // -pi/2 ... pi/2
+		for (aj=0;aj<params.antialias;aj++) {
+			s = j * params.antialias + aj;
+			rays.latitude[s] = latitude0 + aj * M_PI / (params.antialias*params.outheight);
+			rays.coslatitude[s] = cos(rays.latitude[s]);
+			rays.sinlatitude[s] = sin(rays.latitude[s]);
+		}
+	}
+	for (i=0;i<params.outwidth;i++) {
+		longitude0 = TWOPI * i / (double)params.outwidth - PI; // -pi ... pi
+		for (ai=0;ai<params.antialias;ai++) {
+			s = i * params.antialias + ai;
+			rays.longitude[s] = longitude0 + ai * TWOPI / (params.antialias*params.outwidth);
+			rays.coslongitude[s] = cos(rays.longitude[s]);
+			rays.sinlongitude[s] = sin(rays.longitude[s]);
+			rays.fcoslongitude[s] = rays.coslongitude[s];
+			rays.fsinlongitude[s] = rays.sinlongitude[s];
+		}
+	}
+
+	return(TRUE);
+}
+
+void FreeRays(void)
+{
+	free(rays.latitude);
+	free(rays.longitude);
+	free(rays.fcoslongitude);
+	memset(&rays,0,sizeof(RAYTABLE));
+}
+
+/*
+	Ray from camera n into the scene through supersample column is and row js
+*/
+void SampleRay(int n,int is,int js,XYZ *p)
+{
+   p->x = rays.coslatitude[js] * rays.sinlongitude[is];
+   p->y = rays.coslatitude[js] * rays.coslongitude[is];
+   p->z = rays.sinlatitude[js];
+
+	// Turned by 180 degrees for the second fisheye
+	if (n == 1) {
+		p->x = -p->x;
+		p->y = -p->y;
+	}
+}
+
+/*
+	Fractional fisheye coordinates of a ray from camera n
+	The coordinates may lie outside the fisheye image
+	The direction around the fisheye is taken from the ray rather than through
+	atan2() followed by cos() and sin(), only the angle off axis needs atan2()
+	Coordinates agree with that trigonometric evaluation to within 1e-11 pixels,
+	so only a sample lying that close to a pixel edge can change pixel.
+*/
+void RayFishCoord(int n,XYZ p,double *u,double *v)
+{
+	double (*m)[3] = fisheye[n].rotate;
+	double phi,r,rho,cx,cy,radius;
+	XYZ q;
+
+   // Apply fisheye correction transformation
+	q.x = m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z;
+	q.y = m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z;
+	q.z = m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z;
+	p = q;
+
+   // Calculate fisheye coordinates
+   rho = sqrt(p.x*p.x+p.z*p.z);
+   phi = atan2(rho,p.y);
+   r = phi / fisheye[n].fov; // 0 ... 1
+
+   // Determine the u,v coordinate, r * (cos(theta),sin(theta)) with theta = atan2(p.z,p.x)
+	FishGeometry(n,&cx,&cy,&radius);
+	if (rho > 0) {
+		r /= rho;
+   	*u = cx + radius * r * p.x;
+   	*v = cy + radius * r * p.z;
+	} else {
+   	*u = cx + radius * r;
+   	*v = cy;
+	}
+}
+
+/*
+	Fisheye coordinates of the optical axis, the center pixel's corner, and
+	the radius, in pixels of the frame as decoded, see DecodeScale().
+	A mirrored image reflects about the middle of the center pixel, so there
+	the axis is at its far corner, see MakeRotation().
+*/
+void FishGeometry(int n,double *cx,double *cy,double *radius)
+{
+	*cx = (fisheye[n].centerx + (fisheye[n].hflip < 0 ? 1 : 0)) / (double)fisheye[n].scale;
+	*cy = (fisheye[n].centery + (fisheye[n].vflip < 0 ? 1 : 0)) / (double)fisheye[n].scale;
+	*radius = fisheye[n].radius / (double)fisheye[n].scale;
+}
+
+/*
+	Largest reduction, 2, 4 or 8, the batch frames can be decoded at in the DCT
+	domain, see JPEG_Decode(), 1 for full size. The decoded fisheyes must keep
+	DECODEDENSITY pixels per radian for each one across the output equator,
+	and the reduction must divide the frame size. The ffmpeg remap filters
+	address full size frames, so with -r the frames are decoded full size.
+*/
+int DecodeScale(int width,int height)
+{
+	int n,scale;
+
+	if (!params.decodescale)
+		return(1);
+	if (params.makeremap) {
+		fprintf(stderr,"Warning: Frames decoded full size, the remap filters are for full size frames\n");
+		return(1);
+	}
+	for (scale=8;scale>1;scale/=2) {
+		if (width % scale != 0 || height % scale != 0)
+			continue;
+		for (n=0;n<2;n++) {
+			if (fisheye[n].radius / (fisheye[n].fov * scale) < DECODEDENSITY * params.outwidth / TWOPI)
+				break;
+		}
+		if (n == 2)
+			break;
+	}
+
+	return(scale);
+}
+
+/*
+	Given a longitude and latitude calculate the fractional fisheye coordinates
+	For directions between the output supersamples, otherwise use SampleRay()
+*/
+void FishCoord(int n,double latitude,double longitude,double *u,double *v)
+{
+	XYZ p;
+
+	// Turn by 180 degrees for the second fisheye
+	if (n == 1) {
+		longitude += M_PI;
+	}
+
+   // p is the ray from the camera position into the scene
+   p.x = cos(latitude) * sin(longitude);
+   p.y = cos(latitude) * cos(longitude);
+   p.z = sin(latitude);
+
+	RayFishCoord(n,p,u,v);
+}
+
+/*
+	Compare ProjectRays() against the double precision RayFishCoord() over every
+	supersample that lands in the fisheye images. Reports the largest difference
+	and how many samples change pixel, return FALSE if over PROJECTIONERROR.
+*/
+int VerifyProjection(void)
+{
+	int n,is,js,ndiff = 0,ntotal = 0;
+	double fu,fv,e,emax = 0;
+	float *u,*v;
+	XYZ p;
+
+	u = malloc(rays.nlongitude*sizeof(float));
+	v = malloc(rays.nlongitude*sizeof(float));
+	if (u == NULL || v == NULL)
+		return(FALSE);
+	for (n=0;n<2;n++) {
+		for (js=0;js<rays.nlatitude;js++) {
+			kernel.projectrays(n,js,0,rays.nlongitude,u,v);
+			for (is=0;is<rays.nlongitude;is++) {
+				SampleRay(n,is,js,&p);
+				RayFishCoord(n,p,&fu,&fv);
+				if (fu < 0 || fv < 0 || fu >= fisheye[n].width || fv >= fisheye[n].height)
+					continue;
+				e = MAX(fabs(u[is]-fu),fabs(v[is]-fv));
+				emax = MAX(emax,e);
+				if ((int)u[is] != (int)fu || (int)v[is] != (int)fv)
+					ndiff++;
+				ntotal++;
+			}
+		}
+	}
+	free(u);
+	free(v);
+
+	fprintf(stderr,"Projection kernel: largest error %.2g pixels, %d of %d samples (%.3lf%%) in a different pixel\n",
+		emax,ndiff,ntotal,100.0*ndiff/MAX(1,ntotal));
+	if (emax > PROJECTIONERROR) {
+		fprintf(stderr,"Projection kernel: error exceeds the stated %g pixels\n",PROJECTIONERROR);
+		return(FALSE);
+	}
+
+	return(TRUE);
+}
+
+/*
+	Offset of fractional fisheye coordinates into the two fisheye images stored
+	one after the other, return FALSE if outside the fisheye image
+	With a filter the offset is of the top left tap and frac is the fixed point
+	position between the taps, x in the low byte and y in the high byte. Taps
+	are kept inside the camera's own image, the edge pixels are repeated.
+	Whether a sample is used does not depend on the filter or pyramid level,
+	level 0 is the full size image, see MakePyramid().
+*/
+int FishOffset(int n,int level,double fu,double fv,uint32_t *offset,uint16_t *frac,int width,int height)
+{
+	int u,v,fx,fy,ntap,cols = width,rows = height;
+
+	u = fu;
+   if (u < 0 || u >= width)
+      return(FALSE);
+	v = fv;
+   if (v < 0 || v >= height)
+       return(FALSE);
+
+	// Same position in the smaller image
+	if (level > 0) {
+		cols = width >> level;
+		rows = height >> level;
+		fu /= (1 << level);
+		fv /= (1 << level);
+		u = MIN((int)fu,cols-1);
+		v = MIN((int)fv,rows-1);
+	}
+
+	fx = 0;
+	fy = 0;
+	if (params.filter != NEAREST) {
+
+		// Relative to pixel centers, the taps are either side of the sample
+		ntap = FILTERTAPS;
+		u = floor(fu - 0.5);
+		fx = (fu - 0.5 - u) * FRACONE + 0.5;
+		if (fx >= FRACONE) {
+			u++;
+			fx = 0;
+		}
+		u -= ntap / 2 - 1;
+		v = floor(fv - 0.5);
+		fy = (fv - 0.5 - v) * FRACONE + 0.5;
+		if (fy >= FRACONE) {
+			v++;
+			fy = 0;
+		}
+		v -= ntap / 2 - 1;
+
+		if (u < 0) {
+			u = 0;
+			fx = 0;
+		}
+		if (u > cols - ntap) {
+			u = cols - ntap;
+			fx = FRACONE - 1;
+		}
+		if (v < 0) {
+			v = 0;
+			fy = 0;
+		}
+		if (v > rows - ntap) {
+			v = rows - ntap;
+			fy = FRACONE - 1;
+		}
+	}
+
+	// Every level keeps the row stride of the full image
+	*offset = (LevelRow(level,height) + n * rows + v) * (uint32_t)width + u;
+	*frac = fx | (fy << FRACBITS);
+
+	return(TRUE);
+}
+
+/*
+	First row of pyramid level in the source buffer, which holds the two fisheye
+	images at full size, level 0, followed by each smaller level in turn
+*/
+int LevelRow(int level,int height)
+{
+	int l,row = 0;
+
+	for (l=0;l<level;l++)
+		row += 2 * (height >> l);
+
+	return(row);
+}
+
+/*
+	Tap weights of params.filter for each sub pixel position, each set adds up to FRACONE
+	Bicubic uses the cubic B-spline of BiCubicR(), as bitmaplib scales images,
+	it has no negative lobes so filtered values stay within 0 to 255.
+*/
+void MakeFilter(void)
+{
+	int f,k,sum,most;
+	double x;
+
+	for (f=0;f<FRACONE;f++) {
+		x = f / (double)FRACONE;
+		if (params.filter == BICUBIC) {
+			for (k=0;k<4;k++)
+				filterweight[f][k] = BiCubicR(k - 1 - x) * FRACONE + 0.5;
+		} else {
+			filterweight[f][0] = FRACONE - f;
+			filterweight[f][1] = f;
+			filterweight[f][2] = 0;
+			filterweight[f][3] = 0;
+		}
+
+		// Rounding error goes to the largest weight
+		sum = 0;
+		most = 0;
+		for (k=0;k<4;k++) {
+			sum += filterweight[f][k];
+			if (filterweight[f][k] > filterweight[f][most])
+				most = k;
+		}
+		filterweight[f][most] += FRACONE - sum;
+	}
+}
+
+/*
+	Filtered colour of the source at the ntap by ntap taps from FishOffset(),
+	stride is the image width. The rgb values are 0 to 255 with FRACBITS of fraction.
+	Red and blue, and green and alpha, are filtered as pairs of 16 bit lanes in
+	one little endian 32 bit word, the weights are at most FRACONE and add up to
+	FRACONE so a weighted row of pixels cannot carry between lanes. Rows are filtered then
+	scaled back to 8 bits before the vertical pass, the result is within one
+	level of doing it in full precision.
+*/
+#define RBLANES(q) ((q) & 0xff00ff)          // Red and blue of a pixel word
+#define GALANES(q) (((q) >> 8) & 0xff00ff)   // Green and alpha
+
+void FilterSample(BITMAP4 *source,uint32_t offset,uint16_t frac,int stride,int ntap,uint32_t *rgb)
+{
+	int k,m;
+	int *wx = filterweight[frac & (FRACONE-1)],*wy = filterweight[frac >> FRACBITS];
+	uint32_t q,rb,ga,rbsum = 0,gasum = 0;
+	BITMAP4 *p = source + offset;
+
+	for (k=0;k<ntap;k++,p+=stride) {
+		rb = 0;
+		ga = 0;
+		for (m=0;m<ntap;m++) {
+			memcpy(&q,p+m,sizeof(uint32_t));
+			rb += RBLANES(q) * wx[m];
+			ga += GALANES(q) * wx[m];
+		}
+		rbsum += RBLANES(rb >> FRACBITS) * wy[k];
+		gasum += RBLANES(ga >> FRACBITS) * wy[k];
+	}
+	rgb[0] = rbsum & 0xffff;
+	rgb[1] = gasum & 0xffff;
+	rgb[2] = rbsum >> 16;
+}
+
+/*
+	Pyramid level to take supersample s from, the level whose pixels are about
+	the spacing between samples in the source, up to params.mip. The smaller of
+	the spacings across and down is used, the larger blurs too much where the
+	mapping is stretched one way, towards the poles and the rim.
+	The spacing is from the neighbouring supersample across, or the one before
+	at the end of the row of nrun, and the one in the next row down in u[]
+	and v[]. stepx and stepy are how many supersamples apart the samples
+	actually taken are, more than 1 with adaptive antialiasing.
+*/
+int MipLevel(float *u,float *v,int nrun,int s,int k,double stepx,double stepy)
+{
+	int level = 0,s1;
+	double du,dv,spacing,spacing2;
+
+	s1 = (k+1 < nrun) ? s+1 : s-1;
+	du = u[s1] - u[s];
+	dv = v[s1] - v[s];
+	spacing = stepx * stepx * (du*du + dv*dv);
+	du = u[s+nrun] - u[s];
+	dv = v[s+nrun] - v[s];
+	spacing2 = stepy * stepy * (du*du + dv*dv);
+	spacing = sqrt(MIN(spacing,spacing2));
+
+	// Nearest level in log2
+	while (level < params.mip && spacing > M_SQRT2 * (1 << level))
+		level++;
+
+	return(level);
+}
+
+/*
+	Elliptical weighted average taps of camera n for one output pixel, after
+	Heckbert. The ellipse is the pixel's footprint in the source from the
+	Jacobian of the mapping at supersample s, estimated from the neighbouring
+	supersample across, or the one before at the end of the row of nrun,
+	and the one in the next row of u[] and v[], which is the row above if
+	down is FALSE, for a pixel factor columns wide. The semi-axes are
+	EWASCALE of the Jacobian columns and a circle of squared radius EWARECON
+	is added so magnified pixels still cover a pixel. Source pixels whose centers fall inside get gaussian weights,
+	shared out of total, zero weights are dropped.
+	With a pyramid the level is chosen that keeps the taps to EWATAPS,
+	otherwise the ellipse is shrunk to fit. Return the number of taps.
+*/
+int EWATaps(int n,float *u,float *v,int nrun,int s,int k,int factor,int down,int total,int width,int height,uint32_t *offset,uint16_t *weight)
+{
+	int x,y,x0,x1,y0,y1,ntap = 0,level = 0,largest = 0,sum = 0,cols,rows;
+	uint32_t first;
+	uint16_t frac;
+	double ux,vx,uy,vy,a,b,c,f,q,scale,fu = u[s],fv = v[s],g[EWATAPS],gsum = 0;
+
+	if (!FishOffset(n,0,fu,fv,&first,&frac,width,height))
+		return(0);
+
+	// Jacobian in source pixels per output pixel
+	scale = (k+1 < nrun) ? factor * params.antialias : -factor * params.antialias;
+	ux = scale * (u[(k+1 < nrun) ? s+1 : s-1] - fu);
+	vx = scale * (v[(k+1 < nrun) ? s+1 : s-1] - fv);
+	scale = down ? params.antialias : -params.antialias;
+	uy = scale * (u[s+nrun] - fu);
+	vy = scale * (v[s+nrun] - fv);
+	ux *= EWASCALE;
+	vx *= EWASCALE;
+	uy *= EWASCALE;
+	vy *= EWASCALE;
+
+	// Footprint bounding box, (2 ux + 1) by (2 uy + 1) pixels or so, fitted to the tap limit
+	for (;;) {
+		q = (2 * sqrt(ux*ux + uy*uy) + 2) * (2 * sqrt(vx*vx + vy*vy) + 2);
+		if (q <= EWATAPS)
+			break;
+		if (level < params.mip) {
+			level++;
+			fu /= 2;
+			fv /= 2;
+			scale = 0.5;
+		} else {
+			scale = sqrt(EWATAPS / q);
+		}
+		ux *= scale;
+		vx *= scale;
+		uy *= scale;
+		vy *= scale;
+	}
+	cols = width >> level;
+	rows = height >> level;
+
+	// Ellipse a du^2 + b du dv + c dv^2 <= 1
+	a = vx*vx + vy*vy + EWARECON;
+	b = -2 * (ux*vx + uy*vy);
+	c = ux*ux + uy*uy + EWARECON;
+	f = a * c - b * b / 4;
+	a /= f;
+	b /= f;
+	c /= f;
+	q = 4 * a * c - b * b;
+	x0 = MAX(0,(int)floor(fu - 0.5 - sqrt(4 * c / q)));
+	x1 = MIN(cols-1,(int)ceil(fu - 0.5 + sqrt(4 * c / q)));
+	y0 = MAX(0,(int)floor(fv - 0.5 - sqrt(4 * a / q)));
+	y1 = MIN(rows-1,(int)ceil(fv - 0.5 + sqrt(4 * a / q)));
+
+	for (y=y0;y<=y1;y++) {
+		for (x=x0;x<=x1 && ntap<EWATAPS;x++) {
+			q = a * (x + 0.5 - fu) * (x + 0.5 - fu) + b * (x + 0.5 - fu) * (y + 0.5 - fv) +
+				c * (y + 0.5 - fv) * (y + 0.5 - fv);
+			if (q >= 1)
+				continue;
+			g[ntap] = exp(-2 * q);
+			gsum += g[ntap];
+			offset[ntap] = (LevelRow(level,height) + n * rows + y) * (uint32_t)width + x;
+			ntap++;
+		}
+	}
+	if (ntap == 0) { // Only when the center is clipped away, fall back to the nearest pixel
+		offset[0] = first;
+		weight[0] = total;
+		return(1);
+	}
+
+	// Integer shares of total, the rounding goes to the largest
+	for (x=0;x<ntap;x++) {
+		weight[x] = total * g[x] / gsum;
+		sum += weight[x];
+		if (g[x] > g[largest])
+			largest = x;
+	}
+	weight[largest] += total - sum;
+	for (x=0,y=0;x<ntap;x++) {
+		if (weight[x] == 0)
+			continue;
+		offset[y] = offset[x];
+		weight[y] = weight[x];
+		y++;
+	}
+
+	return(y);
+}
+
+/*
+	Average 2x2 blocks of two rows into n pixels of the row below them in the pyramid
+	Red and blue, and green and alpha, are summed as 16 bit lanes as FilterSample()
+*/
+void ReduceRow(BITMAP4 *row0,BITMAP4 *row1,BITMAP4 *out,int n)
+{
+	int i;
+	uint32_t q[4],rb,ga;
+
+	for (i=0;i<n;i++) {
+		memcpy(q,row0+2*i,2*sizeof(uint32_t));
+		memcpy(q+2,row1+2*i,2*sizeof(uint32_t));
+		rb = RBLANES(q[0]) + RBLANES(q[1]) + RBLANES(q[2]) + RBLANES(q[3]) + 0x20002;
+		ga = GALANES(q[0]) + GALANES(q[1]) + GALANES(q[2]) + GALANES(q[3]) + 0x20002;
+		q[0] = RBLANES(rb >> 2) | (RBLANES(ga >> 2) << 8);
+		memcpy(out+i,q,sizeof(uint32_t));
+	}
+}
+
+/*
+	Form rows r0 to r1-1 of a pyramid level, counting the rows of both cameras
+*/
+void ReducePyramidRows(void *arg,int r0,int r1)
+{
+	PYRAMIDJOB *job = arg;
+	int r,n,v,rows = job->height >> job->level,above = job->height >> (job->level-1);
+	BITMAP4 *src,*dst;
+
+	src = job->image + LevelRow(job->level-1,job->height) * (size_t)job->width;
+	dst = job->image + LevelRow(job->level,job->height) * (size_t)job->width;
+	for (r=r0;r<r1;r++) {
+		n = r / rows;
+		v = r % rows;
+		kernel.reducerow(src + (n * above + 2 * v) * (size_t)job->width,
+			src + (n * above + 2 * v + 1) * (size_t)job->width,
+			dst + r * (size_t)job->width,job->width >> job->level);
+	}
+}
+
+/*
+	Form pyramid levels 1 to nlevel of the fisheye pair in image, each is the
+	one before reduced by 2x2 box filtering, see LevelRow() for the layout.
+	Called for each frame after it is decoded.
+*/
+void MakePyramid(BITMAP4 *image,int width,int height,int nlevel)
+{
+	PYRAMIDJOB job;
+
+	job.image = image;
+	job.width = width;
+	job.height = height;
+	for (job.level=1;job.level<=nlevel;job.level++)
+		ParallelRows(2 * (height >> job.level),16,ReducePyramidRows,&job);
+}
+
+/*
+	Reduction across of each output row for -P
+	Rows further than params.polar from the equator only have every 2^level
+	th pixel sampled, over 2^level columns. Towards the poles a row maps to a
+	shrinking circle in the source, the spacing of its pixels there falls
+	about as cos(latitude). The level is the largest that keeps the reduced
+	pixels no more than a source pixel apart anywhere along the row, and that
+	divides the width and tile width, so reduced pixels do not straddle tiles.
+	The reduced pixels are stored packed at the start of each tile's span of
+	the row, see PolarColumn(), so they render as a run. The others are then
+	interpolated by ExpandRow(), whose index and weight for each column are
+	made here for each level used. Return FALSE if out of memory.
+*/
+int MakePolarRows(void)
+{
+	int i,j,l,n,f,js,num,den,cn,cd,tilewidth = MIN(TILEWIDTH,params.outwidth);
+	double latitude,du,dv,spacing;
+	float *u,*v;
+
+	memset(&polar,0,sizeof(POLARROWS));
+	if ((polar.level = calloc(params.outheight,1)) == NULL)
+		return(FALSE);
+	if ((u = malloc(2*rays.nlongitude*sizeof(float))) == NULL)
+		return(FALSE);
+	v = u + rays.nlongitude;
+
+	// The edge of the row nearer the equator decides
+	for (j=0;j<params.outheight && params.polar > 0;j++) {
+		latitude = MIN(fabs(PI * j / params.outheight - PID2),fabs(PI * (j+1) / params.outheight - PID2));
+		if (latitude < params.polar)
+			continue;
+		js = (2*j < params.outheight) ? (j+1) * params.antialias - 1 : j * params.antialias;
+
+		// Largest source pixels per output pixel along the row, where it is used
+		spacing = 0;
+		for (n=0;n<2;n++) {
+			kernel.projectrays(n,js,0,rays.nlongitude,u,v);
+			for (i=params.antialias;i<rays.nlongitude;i+=params.antialias) {
+				if (!InBlendRange(n,rays.longitude[i]) || u[i] < 0 || v[i] < 0 ||
+					u[i] >= fisheye[n].width || v[i] >= fisheye[n].height)
+					continue;
+				du = u[i] - u[i-params.antialias];
+				dv = v[i] - v[i-params.antialias];
+				spacing = MAX(spacing,sqrt(du*du + dv*dv));
+			}
+		}
+		for (l=0;l+1<POLARLEVELS;l++) {
+			f = 2 << l;
+			if (f * spacing > 1 || params.outwidth % f != 0 || tilewidth % f != 0)
+				break;
+		}
+		polar.level[j] = l;
+	}
+	free(u);
+
+	// A pixel's value is taken to be at the mean of its samples, cn/cd of the
+	// way across it, the middle for elliptical weighted average
+	cn = params.ewa ? 1 : params.antialias - 1;
+	cd = params.ewa ? 2 : 2 * params.antialias;
+	for (j=0;j<params.outheight;j++) {
+		l = polar.level[j];
+		if (l == 0 || polar.index[l] != NULL)
+			continue;
+		polar.index[l] = malloc(params.outwidth*sizeof(int32_t));
+		polar.weight[l] = malloc(params.outwidth*sizeof(uint16_t));
+		if (polar.index[l] == NULL || polar.weight[l] == NULL)
+			return(FALSE);
+		f = 1 << l;
+		den = cd * f;
+		for (i=0;i<params.outwidth;i++) {
+			num = cd * i - (f - 1) * cn + den; // Reduced pixels are offset by one, see ExpandPolarRow()
+			polar.index[l][i] = num / den;
+			polar.weight[l][i] = (num % den) * FRACONE / den;
+		}
+	}
+
+	return(TRUE);
+}
+
+/*
+	Column where reduced pixel m of a row at level l is stored, the reduced
+	pixels falling in each tile are packed at the start of its columns
+*/
+int PolarColumn(int m,int l)
+{
+	int i = m << l,tilewidth = MIN(TILEWIDTH,params.outwidth);
+
+	i -= i % tilewidth;
+	return(i + m - (i >> l));
+}
+
+void FreePolarRows(void)
+{
+	int l;
+
+	free(polar.level);
+	for (l=0;l<POLARLEVELS;l++) {
+		free(polar.index[l]);
+		free(polar.weight[l]);
+	}
+	memset(&polar,0,sizeof(POLARROWS));
+}
+
+/*
+	Interpolate n pixels from the row of reduced pixels in, each one weighs
+	in[index] by FRACONE-weight and in[index+1] by weight, rounded
+	Red and blue, and green and alpha, are weighed as 16 bit lanes as FilterSample()
+*/
+void ExpandRow(BITMAP4 *in,int32_t *index,uint16_t *weight,BITMAP4 *out,int n)
+{
+	int i;
+	uint32_t q[2],w,rb,ga;
+
+	for (i=0;i<n;i++) {
+		memcpy(q,in+index[i],2*sizeof(uint32_t));
+		w = weight[i];
+		rb = RBLANES(q[0]) * (FRACONE - w) + RBLANES(q[1]) * w + 0x800080;
+		ga = GALANES(q[0]) * (FRACONE - w) + GALANES(q[1]) * w + 0x800080;
+		q[0] = RBLANES(rb >> FRACBITS) | (RBLANES(ga >> FRACBITS) << 8);
+		memcpy(out+i,q,sizeof(uint32_t));
+	}
+}
+
+/*
+	Fill in output row j of image from its reduced pixels, if it is reduced
+	The reduced pixels are copied out first to reduced, which has room for
+	half the width and two more, with the last and first repeated either side
+	as longitude wraps around.
+*/
+void ExpandPolarRow(BITMAP4 *image,BITMAP4 *reduced,int j)
+{
+	int i,l = polar.level[j],m = params.outwidth >> l,tilewidth = MIN(TILEWIDTH,params.outwidth);
+	BITMAP4 *row = image + j * (size_t)params.outwidth;
+
+	if (l == 0)
+		return;
+	for (i=0;i<params.outwidth;i+=tilewidth) // Packed at the start of each tile, see PolarColumn()
+		memcpy(reduced+1+(i >> l),row+i,(MIN(tilewidth,params.outwidth-i) >> l)*sizeof(BITMAP4));
+	reduced[0] = reduced[m];
+	reduced[m+1] = reduced[1];
+	kernel.expandrow(reduced,polar.index[l],polar.weight[l],row,params.outwidth);
+}
+
+/*
+	Render rows r0 to r1-1 of tiles and fill in their reduced rows while
+	they are still in cache, the rows of tiles are handed out instead of
+	tiles as a reduced row needs all of its tiles.
+*/
+void RenderPolarTiles(void *arg,int r0,int r1)
+{
+	RENDERJOB *job = arg;
+	LLTABLE *table = job->table;
+	BITMAP4 *reduced;
+	int j;
+
+	if ((reduced = malloc((params.outwidth/2+2)*sizeof(BITMAP4))) == NULL)
+		return;
+	RenderLookupTiles(job,r0*table->ntilex,r1*table->ntilex);
+	for (j=r0*table->tileheight;j<MIN(r1*table->tileheight,params.outheight);j++)
+		ExpandPolarRow(job->out,reduced,j);
+	free(reduced);
+}
+
+/*
+	Camera 0 blend weight for a longitude, camera 1 gets 1 - this
+*/
+double BlendWeight(double longitude)
+{
+	double blend;
+
+	if (params.blendwidth > 0) {
+		blend = (params.blendmid + params.blendwidth - fabs(longitude)) / (2*params.blendwidth); // 0 ... 1
+		if (blend < 0) blend = 0;
+		if (blend > 1) blend = 1;
+		if (params.blendpower > 1) {
+			blend = 2 * blend - 1; // -1 to 1
+			blend = 0.5 + 0.5 * SIGN(blend) * pow(fabs(blend),1.0/params.blendpower);
+		}
+	} else { // No blend
+		blend = 0;
+		if (ABS(longitude) <= params.blendmid) // Hard edge
+			blend = 1;
+	}
+
+	return(blend);
+}
+
+/*
+	Split the rows at each reduction into spans of pixels sampled from the
+	same cameras, most of the image comes from one camera and needs no blending.
+	A pixel is single camera where the blend gives the other camera no weight
+	and every supersample across it, over all the columns a reduced pixel
+	covers, is in the camera's blend range. Without split each row is one
+	blended span.
+*/
+int MakeZones(int split)
+{
+	int i,k,l,n,f,stop,zone;
+	uint8_t *column;
+	ZONESPAN *span = NULL;
+
+	if ((column = malloc(params.outwidth)) == NULL)
+		return(FALSE);
+	for (i=0;i<params.outwidth;i++) {
+		column[i] = ZONEOVERLAP;
+		for (n=0;n<2 && split;n++) {
+			if (BlendWeight(rays.longitude[i*params.antialias]) != (n == 0 ? 1 : 0))
+				continue;
+			for (k=0;k<params.antialias && InBlendRange(n,rays.longitude[i*params.antialias+k]);k++)
+				;
+			if (k == params.antialias)
+				column[i] = n;
+		}
+	}
+
+	for (l=0;l<POLARLEVELS;l++) {
+		f = 1 << l;
+		zones.nspan[l] = 0;
+		if ((zones.span[l] = malloc((params.outwidth/f+1)*sizeof(ZONESPAN))) == NULL) {
+			free(column);
+			return(FALSE);
+		}
+		for (i=0;i<params.outwidth;i+=f) {
+			stop = MIN(i+f,params.outwidth);
+			zone = column[i];
+			for (k=i+1;k<stop;k++) {
+				if (column[k] != zone)
+					zone = ZONEOVERLAP;
+			}
+			if (i == 0 || zone != span->zone) {
+				span = zones.span[l] + zones.nspan[l]++;
+				span->start = i;
+				span->zone = zone;
+			}
+			span->stop = stop;
+		}
+	}
+	free(column);
+
+	return(TRUE);
+}
+
+/*
+	Form the pixels of a single camera span of output row j, camera n's
+	supersamples are in u[] and v[] as projected for the row in main().
+	This is the blended pixel loop with the other camera, which has no
+	weight here, and the blend taken out, the result is the same.
+*/
+void RenderCameraSpan(int n,ZONESPAN *span,int j,float *u,float *v,BITMAP4 *out)
+{
+	int i,ai,aj,is,s,ix,iy,nsample,l = polar.level[j],factor = 1 << l;
+	size_t index;
+	COLOUR rgb,sum;
+
+	for (i=span->start;i<span->stop;i+=factor) {
+		sum.r = 0;
+		sum.g = 0;
+		sum.b = 0;
+		nsample = 0;
+		for (ai=0;ai<params.antialias;ai++) {
+			is = i * params.antialias + factor * ai;
+			for (aj=0;aj<params.antialias;aj++) {
+				s = aj * rays.nlongitude + is;
+				if (FishPixel(n,u[s],v[s],&ix,&iy,&rgb)) {
+					sum.r += rgb.r;
+					sum.g += rgb.g;
+					sum.b += rgb.b;
+					nsample++;
+				}
+			}
+		}
+		if (nsample > 0) {
+			sum.r /= nsample;
+			sum.g /= nsample;
+			sum.b /= nsample;
+		}
+		index = j * (size_t)params.outwidth + PolarColumn(i / factor,l);
+		out[index].r = sum.r;
+		out[index].g = sum.g;
+		out[index].b = sum.b;
+	}
+}
+
+/*
+	Tile layout of the lookup table for an output image
+	Tiles are in raster order, those on the right and bottom edges may be partial
+*/
+void LookupTiles(LLTABLE *table,int outwidth,int outheight)
+{
+	table->npixel = outwidth * outheight;
+	table->tilewidth = MIN(TILEWIDTH,outwidth);
+	table->tileheight = MIN(TILEHEIGHT,outheight);
+	table->ntilex = (outwidth + table->tilewidth - 1) / table->tilewidth;
+	table->ntiley = (outheight + table->tileheight - 1) / table->tileheight;
+	table->ntile = table->ntilex * table->ntiley;
+}
+
+/*
+	Output pixels covered by tile t, columns i0 to i1-1 and rows j0 to j1-1
+*/
+void TileBounds(LLTABLE *table,int t,int *i0,int *i1,int *j0,int *j1)
+{
+	*i0 = (t % table->ntilex) * table->tilewidth;
+	*j0 = (t / table->ntilex) * table->tileheight;
+	*i1 = MIN(*i0 + table->tilewidth,params.outwidth);
+	*j1 = MIN(*j0 + table->tileheight,params.outheight);
+}
+
+/*
+	Compute tiles t0 to t1-1 of the lookup table into per tile buffers
+	For each output pixel the samples from camera 0 are stored first followed by
+	those from camera 1, the per camera counts delimit the runs.
+	Each sample carries a fixed point weight, the camera blend divided by the
+	number of samples from that camera, so rendering is a weighted sum.
+	The weights of a camera's run add up exactly to its share of WEIGHTONE.
+	In reduced rows, see MakePolarRows(), only every factor'th pixel is sampled,
+	over factor columns, and stored packed at the start of the tile's row.
+*/
+void BuildLookupTiles(void *arg,int t0,int t1)
+{
+	BUILDJOB *job = arg;
+	LLTABLE *table = job->table;
+	LUTTILE *tile;
+	int i,j,ai,aj,n,index,k,c,t,s,factor;
+	int i0,i1,j0,j1,nrun,any[2];
+	int total[2],a,b,na,nb,js,level,down = TRUE;
+	uint16_t frac;
+	uint64_t nsample,start;
+	float *u[2],*v[2];
+	uint8_t *inrange[2];
+
+	// Fisheye coordinates of the supersamples along each row of a tile, from ProjectRays()
+	// With a pyramid one more row gives the sample spacing down the last of them
+	nrun = table->tilewidth * params.antialias;
+	for (n=0;n<2;n++) {
+		u[n] = malloc(2*nrun*(params.antialias+1)*sizeof(float));
+		v[n] = u[n] + nrun*(params.antialias+1);
+		inrange[n] = malloc(nrun);
+	}
+	if (u[0] == NULL || u[1] == NULL || inrange[0] == NULL || inrange[1] == NULL) {
+		job->failed = TRUE;
+		t1 = t0;
+	}
+
+	for (t=t0;t<t1;t++) {
+		tile = &job->tile[t];
+		TileBounds(table,t,&i0,&i1,&j0,&j1);
+		nsample = (uint64_t)(i1-i0) * (j1-j0) * 2 * (params.ewa ? EWATAPS : params.antialias * params.antialias); // Worst case
+		tile->offset = malloc(nsample*sizeof(uint32_t));
+		tile->weight = malloc(nsample*sizeof(uint16_t));
+		tile->frac = (table->filter != NEAREST) ? malloc(nsample*sizeof(uint16_t)) : NULL;
+		if (tile->offset == NULL || tile->weight == NULL || (table->filter != NEAREST && tile->frac == NULL)) {
+			job->failed = TRUE;
+			break;
+		}
+		nsample = 0;
+
+		// Blend range of the supersample columns, skip cameras the tile does not use
+		nrun = (i1 - i0) * params.antialias;
+		for (n=0;n<2;n++) {
+			any[n] = FALSE;
+			for (k=0;k<nrun;k++) {
+				inrange[n][k] = InBlendRange(n,rays.longitude[i0*params.antialias+k]);
+				any[n] |= inrange[n][k];
+			}
+		}
+
+		for (j=j0;j<j1;j++) {
+			for (n=0;n<2;n++) {
+				for (aj=0;aj<params.antialias && any[n];aj++)
+					kernel.projectrays(n,j*params.antialias+aj,i0*params.antialias,nrun,u[n]+aj*nrun,v[n]+aj*nrun);
+				if ((params.mip > 0 || params.ewa) && any[n]) {
+					js = (j + 1) * params.antialias;
+					down = (js < rays.nlatitude);
+					if (!down) // Last row, the one above is as far
+						js = MAX(0,js-2);
+					kernel.projectrays(n,js,i0*params.antialias,nrun,u[n]+params.antialias*nrun,v[n]+params.antialias*nrun);
+				}
+			}
+			factor = 1 << polar.level[j];
+			if (factor > 1) { // Only the packed reduced pixels have samples
+				memset(table->count[0]+j*params.outwidth+i0,0,i1-i0);
+				memset(table->count[1]+j*params.outwidth+i0,0,i1-i0);
+			}
+			for (i=i0;i<i1;i+=factor) {
+				index = j * params.outwidth + i0 + (i - i0) / factor;
+				total[0] = BlendWeight(rays.longitude[i*params.antialias]) * WEIGHTONE + 0.5;
+				total[1] = WEIGHTONE - total[0];
+				for (n=0;n<2;n++) {
+
+					// Footprint filtered about the middle supersample
+					if (params.ewa) {
+						k = (i - i0) * params.antialias + factor * (params.antialias / 2);
+						c = 0;
+						if (inrange[n][k] && total[n] > 0)
+							c = EWATaps(n,u[n],v[n],nrun,(params.antialias / 2) * nrun + k,k,factor,down,total[n],
+								job->width,job->height,tile->offset+nsample,tile->weight+nsample);
+						nsample += c;
+						table->count[n][index] = c;
+						continue;
+					}
+
+					start = nsample;
+					na = params.antialias;
+					nb = params.antialias;
+					if (params.adaptive && any[n])
+						AdaptiveSamples(u[n],v[n],nrun,(i - i0) * params.antialias,factor,&na,&nb);
+					for (a=0;a<na;a++) {
+						ai = (2 * a + 1) * params.antialias / (2 * na); // a when na is antialias
+						k = (i - i0) * params.antialias + factor * ai;
+						if (!inrange[n][k])
+							continue;
+						for (b=0;b<nb;b++) {
+							aj = (2 * b + 1) * params.antialias / (2 * nb);
+							s = aj * nrun + k;
+							level = 0;
+							if (params.mip > 0)
+								level = MipLevel(u[n],v[n],nrun,s,k,factor*params.antialias/(double)na,params.antialias/(double)nb);
+							if (FishOffset(n,level,u[n][s],v[n][s],&tile->offset[nsample],&frac,job->width,job->height)) {
+								if (tile->frac != NULL)
+									tile->frac[nsample] = frac;
+								nsample++;
+							}
+						} // b
+					} // a
+
+					// Share this camera's weight between its samples, drop them if it has none
+					c = nsample - start;
+					if (total[n] == 0)
+						c = 0;
+					for (k=0;k<c;k++)
+						tile->weight[start+k] = total[n] / c + (k < total[n] % c ? 1 : 0);
+					nsample = start + c;
+					table->count[n][index] = c;
+				} // n
+			} // i
+		} // j
+
+		// Only keep what was used
+		tile->nsample = nsample;
+		if (nsample > 0) {
+			tile->offset = realloc(tile->offset,nsample*sizeof(uint32_t));
+			tile->weight = realloc(tile->weight,nsample*sizeof(uint16_t));
+			if (tile->frac != NULL)
+				tile->frac = realloc(tile->frac,nsample*sizeof(uint16_t));
+		}
+	} // t
+
+	for (n=0;n<2;n++) {
+		free(u[n]);
+		free(inrange[n]);
+	}
+}
+
+/*
+	Number of supersamples needed across and down an output pixel, na and nb,
+	from the size of its footprint in the source, the Jacobian of the mapping
+	estimated from the first two supersamples each way. About one sample per
+	source pixel covered, so pixels mapped near 1:1 get a single sample and
+	only minified ones, towards the rim and poles, the full antialias grid.
+	k is the pixel's first supersample in the row of nrun in u[] and v[],
+	the pixel is factor columns wide.
+*/
+void AdaptiveSamples(float *u,float *v,int nrun,int k,int factor,int *na,int *nb)
+{
+	double du,dv,size;
+
+	if (params.antialias < 2)
+		return;
+
+	// Source pixels spanned by one output pixel across
+	du = u[k+1] - u[k];
+	dv = v[k+1] - v[k];
+	size = factor * params.antialias * sqrt(du*du + dv*dv);
+	*na = (size < params.antialias - 0.5) ? MAX(1,(int)(size + 0.5)) : params.antialias;
+
+	// and down
+	du = u[nrun+k] - u[k];
+	dv = v[nrun+k] - v[k];
+	size = params.antialias * sqrt(du*du + dv*dv);
+	*nb = (size < params.antialias - 0.5) ? MAX(1,(int)(size + 0.5)) : params.antialias;
+}
+
+/*
+	Allocate a table and the per tile buffers of a build job
+*/
+int InitLookupTable(LLTABLE *table,BUILDJOB *job,int width,int height)
+{
+	int n;
+
+	memset(job,0,sizeof(BUILDJOB));
+	LookupTiles(table,params.outwidth,params.outheight);
+	table->nsample = 0;
+	table->tilestart = NULL;
+	table->offset = NULL;
+	table->weight = NULL;
+	table->frac = NULL;
+	table->filter = params.filter;
+	table->stride = width;
+	for (n=0;n<2;n++) {
+		if ((table->count[n] = malloc(table->npixel)) == NULL)
+			return(FALSE);
+	}
+
+	job->table = table;
+	job->width = width;
+	job->height = height;
+	job->failed = FALSE;
+	if ((job->tile = calloc(table->ntile,sizeof(LUTTILE))) == NULL)
+		return(FALSE);
+
+	return(TRUE);
+}
+
+/*
+	Index and concatenate the built tiles into the arrays of table
+	With release the tile buffers are freed as they are copied, otherwise
+	they are left for the caller, who may still be rendering from them.
+*/
+int ConcatLookupTable(BUILDJOB *job,LLTABLE *table,int release)
+{
+	int t,failed = job->failed;
+
+	table->nsample = 0;
+	table->offset = NULL;
+	table->weight = NULL;
+	table->frac = NULL;
+	if ((table->tilestart = malloc((table->ntile+1)*sizeof(uint64_t))) == NULL)
+		failed = TRUE;
+	for (t=0;t<table->ntile && !failed;t++) {
+		table->tilestart[t] = table->nsample;
+		table->nsample += job->tile[t].nsample;
+	}
+	if (!failed) {
+		table->tilestart[table->ntile] = table->nsample;
+		table->offset = malloc(table->nsample*sizeof(uint32_t));
+		table->weight = malloc(table->nsample*sizeof(uint16_t));
+		if (table->filter != NEAREST)
+			table->frac = malloc(table->nsample*sizeof(uint16_t));
+		if (table->offset == NULL || table->weight == NULL || (table->filter != NEAREST && table->frac == NULL))
+			failed = TRUE;
+	}
+	for (t=0;t<table->ntile;t++) {
+		if (!failed) {
+			memcpy(table->offset+table->tilestart[t],job->tile[t].offset,job->tile[t].nsample*sizeof(uint32_t));
+			memcpy(table->weight+table->tilestart[t],job->tile[t].weight,job->tile[t].nsample*sizeof(uint16_t));
+			if (table->frac != NULL)
+				memcpy(table->frac+table->tilestart[t],job->tile[t].frac,job->tile[t].nsample*sizeof(uint16_t));
+		}
+		if (release) {
+			free(job->tile[t].offset);
+			free(job->tile[t].weight);
+			free(job->tile[t].frac);
+		}
+	}
+	if (release) {
+		free(job->tile);
+		job->tile = NULL;
+	}
+
+	return(!failed);
+}
+
+/*
+	Compute the lookup table for the current parameters
+	Tiles are built in parallel then concatenated in order, so the table
+	does not depend on the number of threads.
+*/
+int BuildLookupTable(LLTABLE *table,int width,int height)
+{
+	BUILDJOB job;
+
+	if (!InitLookupTable(table,&job,width,height))
+		return(FALSE);
+	ParallelRows(table->ntile,1,BuildLookupTiles,&job);
+
+	return(ConcatLookupTable(&job,table,TRUE));
+}
+
+/*
+	Make sure tile t of a lazy build is available, building it on this
+	thread if nobody has claimed it yet, otherwise waiting for whoever has.
+*/
+void LookupTile(BUILDJOB *job,int t)
+{
+	pthread_mutex_lock(&job->lock);
+	if (job->state[t] == TILEFREE) {
+		job->state[t] = TILEBUSY;
+		pthread_mutex_unlock(&job->lock);
+		BuildLookupTiles(job,t,t+1);
+		pthread_mutex_lock(&job->lock);
+		job->state[t] = TILEDONE;
+		pthread_cond_broadcast(&job->ready);
+	}
+	while (job->state[t] != TILEDONE)
+		pthread_cond_wait(&job->ready,&job->lock);
+	pthread_mutex_unlock(&job->lock);
+}
+
+void BuildLazyTiles(void *arg,int t0,int t1)
+{
+	BUILDJOB *job = arg;
+	int rendering;
+
+	for (;t0<t1;t0++) {
+		pthread_mutex_lock(&job->lock);
+		rendering = job->rendering;
+		pthread_mutex_unlock(&job->lock);
+		if (rendering)
+			break;
+		LookupTile(job,t0);
+	}
+}
+
+/*
+	Background thread of a lazy build, works through the tiles until the first
+	render starts, from then on the render threads build what is left
+*/
+void *LazyBuilder(void *arg)
+{
+	BUILDJOB *job = arg;
+
+	ParallelRows(job->table->ntile,1,BuildLazyTiles,job);
+
+	return(NULL);
+}
+
+/*
+	Start building the lookup table in the background and return straight away
+	Rendering with the job claims and builds tiles that are not ready yet, so the
+	first frame can be decoded and rendered while the table is being built.
+*/
+int StartLookupTable(BUILDJOB *job,LLTABLE *table,int width,int height)
+{
+	if (!InitLookupTable(table,job,width,height))
+		return(FALSE);
+	if ((job->state = calloc(table->ntile,1)) == NULL)
+		return(FALSE);
+	pthread_mutex_init(&job->lock,NULL);
+	pthread_cond_init(&job->ready,NULL);
+	if (pthread_create(&job->builder,NULL,LazyBuilder,job) == 0)
+		job->building = TRUE;
+	else
+		LazyBuilder(job); // Build it now instead
+
+	return(TRUE);
+}
+
+/*
+	Wait for the background build to complete, return FALSE if it failed
+*/
+int FinishLookupTable(BUILDJOB *job)
+{
+	if (job->building)
+		pthread_join(job->builder,NULL);
+	job->building = FALSE;
+
+	return(!job->failed);
+}
+
+/*
+	Background thread, concatenate a finished lazy build and save it to job->fname
+	Rendering continues from the tile buffers meanwhile
+*/
+void *SaveLookupThread(void *arg)
+{
+	BUILDJOB *job = arg;
+	LLTABLE table = *job->table;
+
+	if (ConcatLookupTable(job,&table,FALSE)) {
+		if (SaveLookupTable(job->fname,job->header,&table))
+			LUT_CacheEvict(params.cachedir,params.cachesize*1024*1024,job->fname);
+	}
+	free(table.tilestart);
+	free(table.offset);
+	free(table.weight);
+	free(table.frac);
+
+	return(NULL);
+}
+
+/*
+	Wait for the background threads of a lazy build and free everything
+*/
+void FreeLazyTable(BUILDJOB *job)
+{
+	int t;
+
+	FinishLookupTable(job);
+	if (job->saving)
+		pthread_join(job->saver,NULL);
+	for (t=0;t<job->table->ntile;t++) {
+		free(job->tile[t].offset);
+		free(job->tile[t].weight);
+		free(job->tile[t].frac);
+	}
+	free(job->tile);
+	free(job->state);
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->ready);
+	FreeLookupTable(job->table);
+}
+
+void FreeLookupTable(LLTABLE *table)
+{
+	free(table->tilestart);
+	free(table->count[0]);
+	free(table->count[1]);
+	free(table->offset);
+	free(table->weight);
+	free(table->frac);
+}
+
+/*
+	Point the table arrays at the sections of a mapped lookup table file
+	Return FALSE if the sections are not the expected shape
+*/
+int MapLookupTable(LUTFILE *lut,LLTABLE *table)
+{
+	LUTHEADER *h = &lut->header;
+
+	LookupTiles(table,h->outwidth,h->outheight);
+	table->nsample = h->nentry;
+	table->filter = h->filter;
+	table->stride = h->srcwidth;
+	table->frac = NULL;
+	if (h->nsection != (table->filter != NEAREST ? 6 : 5) ||
+		table->tilewidth != h->tilewidth || table->tileheight != h->tileheight ||
+		h->section[0].size != (table->ntile+1)*sizeof(uint64_t) ||
+		h->section[1].size != table->npixel || h->section[2].size != table->npixel ||
+		h->section[3].size != table->nsample*sizeof(uint32_t) ||
+		h->section[4].size != table->nsample*sizeof(uint16_t) ||
+		(table->filter != NEAREST && h->section[5].size != table->nsample*sizeof(uint16_t)))
+		return(FALSE);
+	table->tilestart = lut->section[0];
+	table->count[0] = lut->section[1];
+	table->count[1] = lut->section[2];
+	table->offset = lut->section[3];
+	table->weight = lut->section[4];
+	if (table->filter != NEAREST)
+		table->frac = lut->section[5];
+	if (table->tilestart[table->ntile] != table->nsample)
+		return(FALSE);
+
+	return(TRUE);
+}
+
+/*
+	Save the table arrays as the sections of a lookup table file
+	Filtered tables have the sub pixel positions as a sixth section
+*/
+int SaveLookupTable(char *fname,LUTHEADER *h,LLTABLE *table)
+{
+	void *data[6];
+	uint64_t size[6];
+
+	h->nentry = table->nsample;
+	data[0] = table->tilestart;
+	size[0] = (table->ntile+1) * sizeof(uint64_t);
+	data[1] = table->count[0];
+	size[1] = table->npixel;
+	data[2] = table->count[1];
+	size[2] = table->npixel;
+	data[3] = table->offset;
+	size[3] = table->nsample * sizeof(uint32_t);
+	data[4] = table->weight;
+	size[4] = table->nsample * sizeof(uint16_t);
+	data[5] = table->frac;
+	size[5] = table->nsample * sizeof(uint16_t);
+
+	return(LUT_Write(fname,h,data,size,table->filter != NEAREST ? 6 : 5));
+}
+
+static int CompareOffset(const void *a,const void *b)
+{
+	uint32_t u1 = *(const uint32_t *)a,u2 = *(const uint32_t *)b;
+
+	return(u1 < u2 ? -1 : (u1 > u2 ? 1 : 0));
+}
+
+/*
+	Source footprint of the tiles, the mean and largest number of distinct
+	64 byte cache lines each tile gathers from, converted to KB.
+	A tile whose footprint fits in L2 reads each line from memory once.
+	For debug reporting only.
+*/
+void TableFootprint(LLTABLE *table,double *mean,double *largest)
+{
+	int t;
+	uint64_t k,n,nline,sum = 0,most = 0;
+	uint32_t *line;
+
+	for (t=0;t<table->ntile;t++) {
+		n = table->tilestart[t+1] - table->tilestart[t];
+		if ((line = malloc((n+1)*sizeof(uint32_t))) == NULL)
+			break;
+		for (k=0;k<n;k++)
+			line[k] = table->offset[table->tilestart[t]+k] / (64 / sizeof(BITMAP4));
+		qsort(line,n,sizeof(uint32_t),CompareOffset);
+		nline = 0;
+		for (k=0;k<n;k++) {
+			if (k == 0 || line[k] != line[k-1])
+				nline++;
+		}
+		free(line);
+		sum += nline;
+		if (nline > most)
+			most = nline;
+	}
+	*mean = sum * 64.0 / 1024.0 / MAX(1,table->ntile);
+	*largest = most * 64.0 / 1024.0;
+}
+
+/*
+	Form tile t of the spherical image from its run of lookup table samples
+	Blending and antialiasing are folded into the weights, so this is an integer weighted sum
+	The final shift truncates, as the conversion from double did before weights were baked in
+*/
+void RenderTile(LLTABLE *table,int t,LUTTILE *tile,BITMAP4 *source,BITMAP4 *out)
+{
+	int i0,i1,j0,j1,j,k,index,index1,nsample;
+	uint32_t r,g,b,w,*offset = tile->offset;
+	uint16_t *weight = tile->weight;
+
+	TileBounds(table,t,&i0,&i1,&j0,&j1);
+	for (j=j0;j<j1;j++) {
+		index1 = j * params.outwidth + i1;
+		for (index=j*params.outwidth+i0;index<index1;index++) {
+			nsample = table->count[0][index] + table->count[1][index];
+			r = 0;
+			g = 0;
+			b = 0;
+			for (k=0;k<nsample;k++) {
+				w = weight[k];
+				r += w * source[offset[k]].r;
+				g += w * source[offset[k]].g;
+				b += w * source[offset[k]].b;
+			}
+			offset += nsample;
+			weight += nsample;
+			out[index].r = r >> WEIGHTBITS;
+			out[index].g = g >> WEIGHTBITS;
+			out[index].b = b >> WEIGHTBITS;
+			out[index].a = 255;
+		}
+	}
+}
+
+/*
+	As RenderTile() with each sample filtered from its taps, as FilterSample()
+	The filtered values carry FRACBITS of fraction, which the final shift removes
+	Each filter is written out for its number of taps, the general loop is half the speed
+*/
+void RenderFilteredTile(LLTABLE *table,int t,LUTTILE *tile,BITMAP4 *source,BITMAP4 *out)
+{
+	int i0,i1,j0,j1,j,k,l,index,index1,nsample,stride = table->stride;
+	int *wx,*wy;
+	uint32_t r,g,b,w,fx,fy,q[4],rb,ga,rbrow,garow,*offset = tile->offset;
+	uint16_t *weight = tile->weight,*frac = tile->frac;
+	BITMAP4 *p;
+
+	TileBounds(table,t,&i0,&i1,&j0,&j1);
+	for (j=j0;j<j1;j++) {
+		index1 = j * params.outwidth + i1;
+		for (index=j*params.outwidth+i0;index<index1;index++) {
+			nsample = table->count[0][index] + table->count[1][index];
+			r = 0;
+			g = 0;
+			b = 0;
+			for (k=0;k<nsample;k++) {
+				p = source + offset[k];
+				if (table->filter == BILINEAR) {
+					fx = frac[k] & (FRACONE-1);
+					fy = frac[k] >> FRACBITS;
+					memcpy(q,p,2*sizeof(uint32_t));
+					memcpy(q+2,p+stride,2*sizeof(uint32_t));
+					rb = RBLANES(q[0]) * (FRACONE - fx) + RBLANES(q[1]) * fx;
+					ga = GALANES(q[0]) * (FRACONE - fx) + GALANES(q[1]) * fx;
+					rbrow = RBLANES(q[2]) * (FRACONE - fx) + RBLANES(q[3]) * fx;
+					garow = GALANES(q[2]) * (FRACONE - fx) + GALANES(q[3]) * fx;
+					rb = RBLANES(rb >> FRACBITS) * (FRACONE - fy) + RBLANES(rbrow >> FRACBITS) * fy;
+					ga = RBLANES(ga >> FRACBITS) * (FRACONE - fy) + RBLANES(garow >> FRACBITS) * fy;
+				} else {
+					wx = filterweight[frac[k] & (FRACONE-1)];
+					wy = filterweight[frac[k] >> FRACBITS];
+					rb = 0;
+					ga = 0;
+					for (l=0;l<4;l++,p+=stride) {
+						memcpy(q,p,4*sizeof(uint32_t));
+						rbrow = RBLANES(q[0]) * wx[0] + RBLANES(q[1]) * wx[1] + RBLANES(q[2]) * wx[2] + RBLANES(q[3]) * wx[3];
+						garow = GALANES(q[0]) * wx[0] + GALANES(q[1]) * wx[1] + GALANES(q[2]) * wx[2] + GALANES(q[3]) * wx[3];
+						rb += RBLANES(rbrow >> FRACBITS) * wy[l];
+						ga += RBLANES(garow >> FRACBITS) * wy[l];
+					}
+				}
+				w = weight[k];
+				r += w * (rb & 0xffff);
+				g += w * (ga & 0xffff);
+				b += w * (rb >> 16);
+			}
+			offset += nsample;
+			weight += nsample;
+			frac += nsample;
+			out[index].r = r >> (WEIGHTBITS + FRACBITS);
+			out[index].g = g >> (WEIGHTBITS + FRACBITS);
+			out[index].b = b >> (WEIGHTBITS + FRACBITS);
+			out[index].a = 255;
+		}
+	}
+}
+
+/*
+	Form tiles t0 to t1-1 of the spherical image using the lookup table
+	The tile index gives the first sample of each tile so tiles can be rendered independently
+	During a lazy build the samples come from the tile buffers, building any not yet done
+*/
+void RenderLookupTiles(void *arg,int t0,int t1)
+{
+	RENDERJOB *job = arg;
+	LLTABLE *table = job->table;
+	BUILDJOB *build = job->build;
+	LUTTILE tile;
+
+	for (;t0<t1;t0++) {
+		if (build != NULL) {
+			LookupTile(build,t0);
+			if (build->failed)
+				continue;
+			tile = build->tile[t0];
+		} else {
+			tile.nsample = table->tilestart[t0+1] - table->tilestart[t0];
+			tile.offset = table->offset + table->tilestart[t0];
+			tile.weight = table->weight + table->tilestart[t0];
+			tile.frac = (table->frac != NULL) ? table->frac + table->tilestart[t0] : NULL;
+		}
+		if (table->filter != NEAREST)
+			RenderFilteredTile(table,t0,&tile,job->source,job->out);
+		else
+			kernel.rendertile(table,t0,&tile,job->source,job->out);
+	}
+}
+
+/*
+	Form the spherical image from the source fisheye pair using the lookup table
+	Tiles are shared between params.nthreads threads
+	Pass the build job while a lazy build is in progress, otherwise NULL
+*/
+void RenderLookupTable(LLTABLE *table,BUILDJOB *build,BITMAP4 *source,BITMAP4 *out)
+{
+	RENDERJOB job;
+
+	job.table = table;
+	job.build = build;
+	job.mesh = NULL;
+	job.source = source;
+	job.out = out;
+	if (build != NULL) { // Take over from the background builder
+		pthread_mutex_lock(&build->lock);
+		build->rendering = TRUE;
+		pthread_mutex_unlock(&build->lock);
+	}
+	if (params.polar > 0)
+		ParallelRows(table->ntiley,1,RenderPolarTiles,&job);
+	else
+		ParallelRows(table->ntile,1,RenderLookupTiles,&job);
+}
+
+/*
+	Find the kernel variants this CPU can run and use the fastest, or the one
+	named, return FALSE if that is not available.
+	The plain C kernels always work, the others are built with their instruction
+	set enabled in files of their own and only called if the CPU has it
+*/
+int SelectKernels(char *name)
+{
+	int k;
+
+	nkernel = 0;
+	kernels[nkernel].name = "scalar";
+	kernels[nkernel].projectrays = ProjectRays;
+	kernels[nkernel].rendertile = RenderTile;
+	kernels[nkernel].reducerow = ReduceRow;
+	kernels[nkernel].expandrow = ExpandRow;
+	nkernel++;
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2")) {
+		kernels[nkernel].name = "avx2";
+		kernels[nkernel].projectrays = ProjectRaysAVX2;
+		kernels[nkernel].rendertile = RenderTileAVX2;
+		kernels[nkernel].reducerow = ReduceRowAVX2;
+		kernels[nkernel].expandrow = ExpandRowAVX2;
+		nkernel++;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("avx512f")) {
+		kernels[nkernel].name = "avx512";
+		kernels[nkernel].projectrays = ProjectRaysAVX512;
+		kernels[nkernel].rendertile = RenderTileAVX2; // The render is memory bound, the AVX2 gather is kept
+		kernels[nkernel].reducerow = ReduceRowAVX2;
+		kernels[nkernel].expandrow = ExpandRowAVX2;
+		nkernel++;
+	}
+#endif
+	kernel = kernels[nkernel-1];
+	if (name == NULL || name[0] == '\0')
+		return(TRUE);
+
+	for (k=0;k<nkernel;k++) {
+		if (strcmp(kernels[k].name,name) == 0) {
+			kernel = kernels[k];
+			return(TRUE);
+		}
+	}
+	fprintf(stderr,"SelectKernels() - Kernel \"%s\" is not available, this CPU supports",name);
+	for (k=0;k<nkernel;k++)
+		fprintf(stderr," %s",kernels[k].name);
+	fprintf(stderr,"\n");
+	return(FALSE);
+}
+
+/*
+	The AVX2 gathers take signed 32 bit offsets, for sources of 2^31 pixels or
+	more, fisheyes and pyramid together, the variants render with RenderTile()
+*/
+void LimitKernels(uint64_t npixel)
+{
+	int k;
+
+	if (npixel <= INT32_MAX)
+		return;
+	for (k=0;k<nkernel;k++)
+		kernels[k].rendertile = RenderTile;
+	if (kernel.rendertile != RenderTile && params.debug)
+		fprintf(stderr,"LimitKernels() - Source too large for the %s render, using the scalar render\n",kernel.name);
+	kernel.rendertile = RenderTile;
+}
+
+/*
+	Render a frame with each kernel variant, report the best of params.benchmark
+	times for each and whether it matches the scalar kernel, the image in out is
+	left as rendered by the variant in use.
+	The projection of every supersample ray, the bulk of a table build, is timed
+	the same way on one thread and its coordinates compared.
+*/
+void BenchmarkKernels(LLTABLE *table,BUILDJOB *build,BITMAP4 *source,BITMAP4 *out)
+{
+	int k,m,n,js,same;
+	size_t size = params.outwidth * (size_t)params.outheight * sizeof(BITMAP4);
+	double t,best,bestproject;
+	uint64_t hash = 0,reference = 0;
+	float *u,*v;
+	KERNEL inuse = kernel;
+	BITMAP4 *image;
+
+	if ((image = malloc(size)) == NULL)
+		return;
+	if ((u = malloc(2*rays.nlongitude*sizeof(float))) == NULL) {
+		free(image);
+		return;
+	}
+	v = u + rays.nlongitude;
+	for (k=0;k<nkernel;k++) {
+		kernel = kernels[k];
+		best = 1e32;
+		bestproject = 1e32;
+		for (m=0;m<params.benchmark;m++) {
+			t = GetTime();
+			RenderLookupTable(table,build,source,out);
+			best = MIN(best,GetTime()-t);
+			t = GetTime();
+			hash = 0;
+			for (n=0;n<2;n++) {
+				for (js=0;js<rays.nlatitude;js++) {
+					kernel.projectrays(n,js,0,rays.nlongitude,u,v);
+					hash = LUT_Hash(u,2*rays.nlongitude*sizeof(float),hash);
+				}
+			}
+			bestproject = MIN(bestproject,GetTime()-t);
+		}
+		if (k == 0) {
+			memcpy(image,out,size);
+			reference = hash;
+		}
+		same = (memcmp(image,out,size) == 0 && hash == reference);
+		fprintf(stderr,"Kernel %-8s %.4lf seconds per frame, %.4lf seconds projection%s%s\n",
+			kernels[k].name,best,bestproject,same ? "" : ", DIFFERS from scalar",
+			strcmp(kernels[k].name,inuse.name) == 0 ? " (in use)" : "");
+	}
+	kernel = inuse;
+	RenderLookupTable(table,build,source,out);
+	free(image);
+	free(u);
+}
+
+/*
+	Mesh remap, an alternative to the lookup table for batch mode
+	The fisheye coordinates are evaluated on a coarse grid over the output image
+	and interpolated bilinearly inside each cell. Cells are split until the error
+	at the cell center and edge midpoints is within params.meshtolerance source
+	pixels, single pixel cells that still fail are evaluated exactly per sample.
+	The mesh is small enough to stay in cache and is rebuilt each run.
+*/
+
+/*
+	Fisheye coordinates of both cameras at a point in output pixel units
+*/
+void MeshNode(double x,double y,MESHNODE *node)
+{
+	int n;
+	double latitude,longitude,u,v;
+
+	longitude = TWOPI * x / params.outwidth - PI; // -pi ... pi
+	latitude = PI * y / params.outheight - PID2;  // -pi/2 ... pi/2
+	for (n=0;n<2;n++) {
+		FishCoord(n,latitude,longitude,&u,&v);
+		node->u[n] = u;
+		node->v[n] = v;
+	}
+}
+
+/*
+	Add a cell to a coarse row of the mesh
+*/
+int MeshAddCell(MESHROW *row,MESHCELL *cell)
+{
+	MESHCELL *more;
+
+	if (row->ncell >= row->nalloc) {
+		if ((more = realloc(row->cell,(row->nalloc+256)*sizeof(MESHCELL))) == NULL)
+			return(FALSE); // The row keeps its cells, they are freed with the rest
+		row->cell = more;
+		row->nalloc += 256;
+	}
+	row->cell[row->ncell++] = *cell;
+	return(TRUE);
+}
+
+/*
+	Test a cell against the error bound, splitting it into four if it fails
+	Corners are in the order (x,y), (x+s,y), (x,y+s), (x+s,y+s)
+*/
+int MeshSplit(MESH *mesh,MESHROW *row,int x,int y,int s,MESHNODE *c)
+{
+	int n,k,h,split = FALSE;
+	double rr,limit,err,du,dv,ax,ay,radius;
+	MESHNODE m[5],q[4];
+	MESHCELL cell;
+	static double fu[5][4] = { // Bilinear weights of the corners at the test points
+		{0.5,0.5,0,0},{0.5,0,0.5,0},{0.25,0.25,0.25,0.25},{0,0.5,0,0.5},{0,0,0.5,0.5}};
+
+	cell.x = x;
+	cell.y = y;
+	cell.size = s;
+	for (k=0;k<4;k++)
+		cell.corner[k] = c[k];
+
+	// Cells well outside a camera's image, phi cannot drop by more than the cell's angular size
+	for (n=0;n<2;n++) {
+		cell.flag[n] = MESHFAR;
+		limit = mesh->rmax[n] + 1.5 * s * (TWOPI / params.outwidth) / fisheye[n].fov;
+		FishGeometry(n,&ax,&ay,&radius);
+		for (k=0;k<4;k++) {
+			du = c[k].u[n] - ax;
+			dv = c[k].v[n] - ay;
+			rr = sqrt(du*du + dv*dv) / radius;
+			if (rr <= limit)
+				cell.flag[n] = 0;
+		}
+	}
+	if (cell.flag[0] == MESHFAR && cell.flag[1] == MESHFAR)
+		return(MeshAddCell(row,&cell));
+
+	// Top, left, center, right and bottom test points
+	h = s / 2;
+	MeshNode(x+0.5*s,y,&m[0]);
+	MeshNode(x,y+0.5*s,&m[1]);
+	MeshNode(x+0.5*s,y+0.5*s,&m[2]);
+	MeshNode(x+s,y+0.5*s,&m[3]);
+	MeshNode(x+0.5*s,y+s,&m[4]);
+	for (n=0;n<2;n++) {
+		if (cell.flag[n] == MESHFAR)
+			continue;
+		err = 0;
+		for (k=0;k<5;k++) {
+			du = fu[k][0]*c[0].u[n] + fu[k][1]*c[1].u[n] + fu[k][2]*c[2].u[n] + fu[k][3]*c[3].u[n] - m[k].u[n];
+			dv = fu[k][0]*c[0].v[n] + fu[k][1]*c[1].v[n] + fu[k][2]*c[2].v[n] + fu[k][3]*c[3].v[n] - m[k].v[n];
+			err = MAX(err,MAX(fabs(du),fabs(dv)));
+		}
+		if (err > params.meshtolerance) {
+			if (s > 1)
+				split = TRUE;
+			else
+				cell.flag[n] = MESHEXACT;
+		}
+	}
+	if (!split)
+		return(MeshAddCell(row,&cell));
+
+	q[0] = c[0]; q[1] = m[0]; q[2] = m[1]; q[3] = m[2];
+	if (!MeshSplit(mesh,row,x,y,h,q))
+		return(FALSE);
+	q[0] = m[0]; q[1] = c[1]; q[2] = m[2]; q[3] = m[3];
+	if (!MeshSplit(mesh,row,x+h,y,h,q))
+		return(FALSE);
+	q[0] = m[1]; q[1] = m[2]; q[2] = c[2]; q[3] = m[4];
+	if (!MeshSplit(mesh,row,x,y+h,h,q))
+		return(FALSE);
+	q[0] = m[2]; q[1] = m[3]; q[2] = m[4]; q[3] = c[3];
+	return(MeshSplit(mesh,row,x+h,y+h,h,q));
+}
+
+/*
+	Build coarse rows r0 to r1-1 of the mesh
+*/
+void BuildMeshRows(void *arg,int r0,int r1)
+{
+	MESHJOB *job = arg;
+	MESH *mesh = job->mesh;
+	int r,i,ncol;
+	MESHNODE *top,*bottom,c[4];
+
+	ncol = (params.outwidth + MESHSIZE - 1) / MESHSIZE;
+	top = malloc((ncol+1)*sizeof(MESHNODE));
+	bottom = malloc((ncol+1)*sizeof(MESHNODE));
+	if (top == NULL || bottom == NULL) {
+		job->failed = TRUE;
+		return;
+	}
+
+	for (r=r0;r<r1;r++) {
+		for (i=0;i<=ncol;i++) {
+			MeshNode(i*MESHSIZE,r*MESHSIZE,&top[i]);
+			MeshNode(i*MESHSIZE,(r+1)*MESHSIZE,&bottom[i]);
+		}
+		for (i=0;i<ncol;i++) {
+			c[0] = top[i];
+			c[1] = top[i+1];
+			c[2] = bottom[i];
+			c[3] = bottom[i+1];
+			if (!MeshSplit(mesh,&job->row[r],i*MESHSIZE,r*MESHSIZE,MESHSIZE,c))
+				job->failed = TRUE;
+		}
+	}
+
+	free(top);
+	free(bottom);
+}
+
+/*
+	Build the mesh for the current parameters
+	Also precomputes the per column camera weights and blend ranges
+*/
+int BuildMesh(MESH *mesh,int width,int height)
+{
+	int i,ai,n,r,k;
+	double longitude,du,dv,cx[4] = {0,1,0,1},cy[4] = {0,0,1,1},ax,ay,radius;
+	MESHJOB job;
+
+	memset(mesh,0,sizeof(MESH));
+	mesh->width = width;
+	mesh->height = height;
+	for (n=0;n<2;n++) {
+
+		// Furthest image corner from the fisheye center, relative to the radius
+		mesh->rmax[n] = 0;
+		FishGeometry(n,&ax,&ay,&radius);
+		for (k=0;k<4;k++) {
+			du = cx[k] * width - ax;
+			dv = cy[k] * height - ay;
+			mesh->rmax[n] = MAX(mesh->rmax[n],sqrt(du*du + dv*dv) / radius);
+		}
+
+		mesh->total[n] = malloc(params.outwidth*sizeof(int));
+		mesh->inrange[n] = malloc(params.outwidth*params.antialias);
+		if (mesh->total[n] == NULL || mesh->inrange[n] == NULL) {
+			FreeMesh(mesh);
+			return(FALSE);
+		}
+	}
+	for (i=0;i<params.outwidth;i++) {
+		longitude = TWOPI * i / (double)params.outwidth - PI; // -pi ... pi
+		mesh->total[0][i] = BlendWeight(longitude) * WEIGHTONE + 0.5;
+		mesh->total[1][i] = WEIGHTONE - mesh->total[0][i];
+		for (n=0;n<2;n++) {
+			for (ai=0;ai<params.antialias;ai++)
+				mesh->inrange[n][i*params.antialias+ai] = InBlendRange(n,longitude + ai * TWOPI / (params.antialias * params.outwidth));
+		}
+	}
+
+	mesh->nrow = (params.outheight + MESHSIZE - 1) / MESHSIZE;
+	job.mesh = mesh;
+	job.failed = FALSE;
+	if ((job.row = calloc(mesh->nrow,sizeof(MESHROW))) == NULL) {
+		FreeMesh(mesh);
+		return(FALSE);
+	}
+	ParallelRows(mesh->nrow,1,BuildMeshRows,&job);
+
+	// Concatenate the rows
+	mesh->ncell = 0;
+	if ((mesh->rowstart = malloc((mesh->nrow+1)*sizeof(int))) == NULL)
+		job.failed = TRUE;
+	for (r=0;r<mesh->nrow && !job.failed;r++) {
+		mesh->rowstart[r] = mesh->ncell;
+		mesh->ncell += job.row[r].ncell;
+	}
+	if (!job.failed) {
+		mesh->rowstart[mesh->nrow] = mesh->ncell;
+		if ((mesh->cell = malloc(mesh->ncell*sizeof(MESHCELL))) == NULL)
+			job.failed = TRUE;
+	}
+	for (r=0;r<mesh->nrow;r++) {
+		if (!job.failed)
+			memcpy(mesh->cell+mesh->rowstart[r],job.row[r].cell,job.row[r].ncell*sizeof(MESHCELL));
+		free(job.row[r].cell);
+	}
+	free(job.row);
+	if (job.failed)
+		FreeMesh(mesh);
+
+	return(!job.failed);
+}
+
+void FreeMesh(MESH *mesh)
+{
+	free(mesh->rowstart);
+	free(mesh->cell);
+	free(mesh->total[0]);
+	free(mesh->total[1]);
+	free(mesh->inrange[0]);
+	free(mesh->inrange[1]);
+	memset(mesh,0,sizeof(MESH));
+}
+
+/*
+	Form the output pixels covered by coarse rows r0 to r1-1 of the mesh
+*/
+void RenderMeshRows(void *arg,int r0,int r1)
+{
+	RENDERJOB *job = arg;
+	MESH *mesh = job->mesh;
+	MESHCELL *cell;
+	BITMAP4 *source = job->source,*out = job->out;
+	int ic,i,j,ai,aj,n,index,sc;
+	int count[2],w[2];
+	uint16_t frac;
+	uint32_t offset,rgb[3];
+	uint64_t sum[2][3];
+	double fx,fy,u,v;
+	XYZ p;
+
+	for (ic=mesh->rowstart[r0];ic<mesh->rowstart[r1];ic++) {
+		cell = &mesh->cell[ic];
+		for (j=cell->y;j<cell->y+cell->size && j<params.outheight;j++) {
+			for (i=cell->x;i<cell->x+cell->size && i<params.outwidth;i++) {
+				for (n=0;n<2;n++) {
+					count[n] = 0;
+					sum[n][0] = 0;
+					sum[n][1] = 0;
+					sum[n][2] = 0;
+					if (cell->flag[n] == MESHFAR)
+						continue;
+					for (ai=0;ai<params.antialias;ai++) {
+						sc = i * params.antialias + ai;
+						if (!mesh->inrange[n][sc])
+							continue;
+						fx = (sc / (double)params.antialias - cell->x) / cell->size;
+						for (aj=0;aj<params.antialias;aj++) {
+							fy = ((j * params.antialias + aj) / (double)params.antialias - cell->y) / cell->size;
+							if (cell->flag[n] == MESHEXACT) {
+								SampleRay(n,sc,j*params.antialias+aj,&p);
+								RayFishCoord(n,p,&u,&v);
+							} else {
+								u = (1-fy) * ((1-fx) * cell->corner[0].u[n] + fx * cell->corner[1].u[n]) +
+									    fy  * ((1-fx) * cell->corner[2].u[n] + fx * cell->corner[3].u[n]);
+								v = (1-fy) * ((1-fx) * cell->corner[0].v[n] + fx * cell->corner[1].v[n]) +
+									    fy  * ((1-fx) * cell->corner[2].v[n] + fx * cell->corner[3].v[n]);
+							}
+							if (!FishOffset(n,0,u,v,&offset,&frac,mesh->width,mesh->height))
+								continue;
+							if (params.filter != NEAREST) {
+								FilterSample(source,offset,frac,mesh->width,FILTERTAPS,rgb);
+							} else {
+								rgb[0] = source[offset].r << FRACBITS;
+								rgb[1] = source[offset].g << FRACBITS;
+								rgb[2] = source[offset].b << FRACBITS;
+							}
+							sum[n][0] += rgb[0];
+							sum[n][1] += rgb[1];
+							sum[n][2] += rgb[2];
+							count[n]++;
+						} // aj
+					} // ai
+				} // n
+
+				// Same weighting as the lookup table
+				for (n=0;n<2;n++)
+					w[n] = count[n] > 0 ? mesh->total[n][i] / count[n] : 0;
+				index = j * params.outwidth + i;
+				out[index].r = (sum[0][0] * w[0] + sum[1][0] * w[1]) >> (WEIGHTBITS + FRACBITS);
+				out[index].g = (sum[0][1] * w[0] + sum[1][1] * w[1]) >> (WEIGHTBITS + FRACBITS);
+				out[index].b = (sum[0][2] * w[0] + sum[1][2] * w[1]) >> (WEIGHTBITS + FRACBITS);
+				out[index].a = 255;
+			} // i
+		} // j
+	} // ic
+}
+
+/*
+	Form the spherical image from the source fisheye pair using the mesh
+*/
+void RenderMesh(MESH *mesh,BITMAP4 *source,BITMAP4 *out)
+{
+	RENDERJOB job;
+
+	job.table = NULL;
+	job.build = NULL;
+	job.mesh = mesh;
+	job.source = source;
+	job.out = out;
+	ParallelRows(mesh->nrow,1,RenderMeshRows,&job);
+}
+
+/*
+	Hand out bands of rows to the worker threads until all are done
+*/
+void *ParallelRowsWorker(void *arg)
+{
+	PARALLELROWS *pr = arg;
+	int j0;
+
+	for (;;) {
+		pthread_mutex_lock(&pr->lock);
+		j0 = pr->next;
+		pr->next += pr->chunk;
+		pthread_mutex_unlock(&pr->lock);
+		if (j0 >= pr->nrows)
+			break;
+		pr->fn(pr->arg,j0,MIN(j0+pr->chunk,pr->nrows));
+	}
+
+	return(NULL);
+}
+
+/*
+	Call fn(arg,j0,j1) over all nrows rows in bands of chunk rows using params.nthreads threads
+	fn must only write to the rows it is given. The threads are created for
+	each call and joined before it returns, so calls may come from several
+	threads at once. Without memory for the threads the rows are done here.
+*/
+void ParallelRows(int nrows,int chunk,void (*fn)(void *,int,int),void *arg)
+{
+	int i,nthreads;
+	pthread_t *thread;
+	PARALLELROWS pr;
+
+	nthreads = MIN(params.nthreads,(nrows+chunk-1)/chunk);
+	if (nthreads <= 1) {
+		fn(arg,0,nrows);
+		return;
+	}
+
+	pr.nrows = nrows;
+	pr.chunk = chunk;
+	pr.next = 0;
+	pr.fn = fn;
+	pr.arg = arg;
+	if ((thread = malloc(nthreads*sizeof(pthread_t))) == NULL) {
+		fn(arg,0,nrows);
+		return;
+	}
+	pthread_mutex_init(&pr.lock,NULL);
+	for (i=0;i<nthreads;i++) {
+		if (pthread_create(&thread[i],NULL,ParallelRowsWorker,&pr) != 0) {
+			nthreads = i;
+			break;
+		}
+	}
+	ParallelRowsWorker(&pr); // Also do some work on this thread
+	for (i=0;i<nthreads;i++)
+		pthread_join(thread[i],NULL);
+	pthread_mutex_destroy(&pr.lock);
+	free(thread);
+}
+
+/*
+	Encoders for a width by height output image in params quality, subsampling
+	and DCT method. With more than one thread the image is cut into JPEGSTRIPS
+	strips per thread, whole MCU rows each, encoded at once and joined with
+	restart markers. With one thread it is encoded whole exactly as before.
+*/
+int NewStripEncoder(STRIPENCODER *se,int width,int height,int nthreads)
+{
+	int i;
+
+	memset(se,0,sizeof(STRIPENCODER));
+	se->width = width;
+	se->height = height;
+	se->rows = height;
+	se->nstrip = 1;
+	if (nthreads > 1) {
+		se->rows = JPEG_StripRows(params.subsample,width,height,JPEGSTRIPS*nthreads);
+		se->nstrip = (height + se->rows - 1) / se->rows;
+	}
+	if ((se->strip = calloc(se->nstrip,sizeof(JPEGENCODER *))) == NULL)
+		return(FALSE);
+	for (i=0;i<se->nstrip;i++) {
+		if ((se->strip[i] = JPEG_NewEncoder()) == NULL)
+			return(FALSE);
+		se->strip[i]->subsample = params.subsample;
+		se->strip[i]->dct = params.dctmethod;
+	}
+
+	return(TRUE);
+}
+
+/*
+	Encode strips i0 to i1 of the image, each with its own encoder
+*/
+void EncodeStrips(void *arg,int i0,int i1)
+{
+	int i,j0;
+	STRIPENCODER *se = arg;
+
+	for (i=i0;i<i1;i++) {
+		j0 = i * se->rows;
+		JPEG_EncodeStrip(se->strip[i],se->image,se->width,se->height,j0,MIN(j0+se->rows,se->height),params.quality);
+	}
+}
+
+/*
+	Write the output image to fptr, bottom row first as the other writers
+	Return FALSE on failure, the reason is in se->error
 */
-int FindFishPixelBatch(int n,double latitude,double longitude,UV *uv, int width, int height)
+int EncodeOutput(STRIPENCODER *se,FILE *fptr,BITMAP4 *image)
 {
-	char ind[256];
-	int k,index;
-	XYZ p,q = {0,0,0};
-	double theta,phi,r;
-	int u,v;
-	UV fuv;
+	int i;
 
-   // Ignore pixels that will never be touched because out of blend range
-   if (n == 0) {
-      if (longitude > params.blendmid + params.blendwidth || longitude < -params.blendmid - params.blendwidth)
-			return(FALSE);
-	}
-   if (n == 1) {
-      if (longitude > -params.blendmid + params.blendwidth && longitude < params.blendmid - params.blendwidth)
-			return(FALSE); 
-   }
+	se->error = se->strip[0]->err.message;
+	if (se->nstrip == 1)
+		return(JPEG_Encode(se->strip[0],fptr,image,se->width,se->height,params.quality));
 
-	// Turn by 180 degrees for the second fisheye
-	if (n == 1) {
-		longitude += M_PI;
-		//printf("\nturn 180 deg %lf\n", longitude);
+	se->image = image;
+	ParallelRows(se->nstrip,1,EncodeStrips,se);
+	for (i=0;i<se->nstrip;i++) {
+		if (se->strip[i]->err.message[0] != '\0') {
+			se->error = se->strip[i]->err.message;
+			return(FALSE);
+		}
 	}
 
-   // p is the ray from the camera position into the scene
-   p.x = cos(latitude) * sin(longitude);
-   p.y = cos(latitude) * cos(longitude);
-   p.z = sin(latitude);
-
-   
+	return(JPEG_JoinStrips(fptr,se->strip,se->nstrip,se->width,se->height,se->rows));
+}
 
-   // Apply fisheye correction transformation
-   for (k=0;k<fisheye[n].ntransform;k++) {
-	   printf("Apply fisheye correction transformation");
-      switch(fisheye[n].transform[k].axis) {
-      case XTILT:
-		   q.x =  p.x;
-   		q.y =  p.y * fisheye[n].transform[k].cvalue + p.z * fisheye[n].transform[k].svalue;
-   		q.z = -p.y * fisheye[n].transform[k].svalue + p.z * fisheye[n].transform[k].cvalue;
-         break;
-      case YROLL:
-		   q.x =  p.x * fisheye[n].transform[k].cvalue + p.z * fisheye[n].transform[k].svalue;
-		   q.y =  p.y;
-		   q.z = -p.x * fisheye[n].transform[k].svalue + p.z * fisheye[n].transform[k].cvalue;
-         break;
-      case ZPAN:
-		   q.x =  p.x * fisheye[n].transform[k].cvalue + p.y * fisheye[n].transform[k].svalue;
-		   q.y = -p.x * fisheye[n].transform[k].svalue + p.y * fisheye[n].transform[k].cvalue;
-		   q.z =  p.z;
-         break;
-      }
-		p = q;
-   }
+void FreeStripEncoder(STRIPENCODER *se)
+{
+	int i;
 
-   // Calculate fisheye coordinates
-   theta = atan2(p.z,p.x);
-   phi = atan2(sqrt(p.x*p.x+p.z*p.z),p.y);
-   r = phi / fisheye[n].fov; // 0 ... 1
+	if (se->strip == NULL)
+		return;
+	for (i=0;i<se->nstrip;i++)
+		JPEG_FreeEncoder(se->strip[i]);
+	free(se->strip);
+	se->strip = NULL;
+}
 
-   // Determine the u,v coordinate
-   u = fisheye[n].centerx + fisheye[n].radius * r * cos(theta);
-   //printf("u: %d, fisheye[n].width: %d", u, fisheye[n].width);
-   if (u < 0 || u >= width)
-      return(FALSE);
+/*
+	Encode the output image params.benchmark times whole on one thread, as
+	before the strips, and with the strip encoder in use. Report the best
+	time and the file size of each.
+*/
+void BenchmarkEncoder(STRIPENCODER *se,BITMAP4 *image)
+{
+	int k,m;
+	double t,best;
+	long size = 0;
+	FILE *fptr;
+	STRIPENCODER single,*enc;
 
-   v = fisheye[n].centery + fisheye[n].radius * r * sin(theta);
+	if (!NewStripEncoder(&single,se->width,se->height,1)) {
+		FreeStripEncoder(&single);
+		return;
+	}
+	for (k=0;k<2;k++) {
+		enc = (k == 0) ? &single : se;
+		best = 1e32;
+		for (m=0;m<params.benchmark;m++) {
+			if ((fptr = tmpfile()) == NULL)
+				break;
+			t = GetTime();
+			if (!EncodeOutput(enc,fptr,image))
+				fprintf(stderr,"BenchmarkEncoder() - Failed to encode, %s\n",enc->error);
+			best = MIN(best,GetTime()-t);
+			size = ftell(fptr);
+			fclose(fptr);
+		}
+		fprintf(stderr,"Encoder %3d strip%s %.4lf seconds per frame, %.2lf MB\n",
+			enc->nstrip,enc->nstrip == 1 ? " " : "s",best,size/(1024.0*1024.0));
+	}
+	FreeStripEncoder(&single);
+}
 
-   if (v < 0 || v >= height)
-       return(FALSE);
-	index = v * width + u;
-	
-	sprintf(ind,"%d%d",index, n);
-	fuv.index = atoi(ind);
+/*
+	Hash of everything that affects the mapping stored in the lookup table
+	Used to reject tables built for a different parameter file or blend settings
+*/
+uint64_t TableHash(void)
+{
+	int n,k;
+	uint64_t h = 0;
 
-	*uv = fuv;
+	for (n=0;n<2;n++) {
+		h = LUT_Hash(&fisheye[n].centerx,sizeof(int),h);
+		h = LUT_Hash(&fisheye[n].centery,sizeof(int),h);
+		h = LUT_Hash(&fisheye[n].radius,sizeof(int),h);
+		h = LUT_Hash(&fisheye[n].fov,sizeof(double),h);
+		h = LUT_Hash(&fisheye[n].ntransform,sizeof(int),h);
+		if (fisheye[n].hflip < 0 || fisheye[n].vflip < 0) { // Tables without them keep their keys
+			h = LUT_Hash(&fisheye[n].hflip,sizeof(int),h);
+			h = LUT_Hash(&fisheye[n].vflip,sizeof(int),h);
+		}
+		for (k=0;k<fisheye[n].ntransform;k++) {
+			h = LUT_Hash(&fisheye[n].transform[k].axis,sizeof(int),h);
+			h = LUT_Hash(&fisheye[n].transform[k].value,sizeof(double),h);
+		}
+	}
+	h = LUT_Hash(&params.blendmid,sizeof(double),h);
+	h = LUT_Hash(&params.blendwidth,sizeof(double),h);
+	h = LUT_Hash(&params.blendpower,sizeof(double),h);
+	if (params.polar > 0) // Tables made without -P keep their key
+		h = LUT_Hash(&params.polar,sizeof(double),h);
 
-	return(TRUE);
+	return(h);
 }
 
 int startDirectoryExtraction(int argc, char **argv, char *front, char *back, char *out, int nstart, int nstop){
 	char fname1[256], fname2[256];
 	int width=0, height=0;
 
-	int i,j,aj,ai,n=0;
-	int index,nantialias[2];
-	int inblendzone = FALSE;
 	char basename[256];
-	BITMAP4 black = {0,0,0,255};
-	double latitude0,longitude0,latitude,longitude; 
-	double blend = 1;
-	COLOUR rgbsum[2],rgbzero = {0,0,0};
 	int noptiterations = 1; // > 1 for optimisation
 	char fnameout[256],tablename[256];
-	FILE *fptr;
-	int ntable = 0;
-	int itable = 0;
-
-	int nframe, nt=0, nn = 0;
-	double dx,dy;
-
-	if(inblendzone != FALSE){
-		inblendzone = FALSE;
-	}
-	
+	LUTHEADER header;
+	LUTFILE lut;
+	LLTABLE table;
+	BUILDJOB build,*lazy = NULL;
+	MESH mesh;
+	int nframe,j,n;
+	double starttime,mean,largest;
+	JPEGDECODER *decoder[2];
+	FRAMEJOB frame[2],*job;
+	STRIPENCODER encoder;
 
 	if ((strlen(front) > 2) && (strlen(back) > 2) && (strlen(out) > 2)) {
 		if (!CheckTemplate(front,1))     
@@ -235,29 +2439,44 @@ int startDirectoryExtraction(int argc, char **argv, char *front, char *back, cha
 		fprintf(stderr,"%s() - Expect frame template %d\n",argv[0],whichtemplate+1);
 	}
 
+	params.mip = MIN(params.mip,MAXLEVEL);
 	fisheye[0].width = width;
 	fisheye[0].height = height;
 	fisheye[1].width = width;
 	fisheye[1].height = height;
 
-   // Memory for images
-   fisheye[0].image = Create_Bitmap(width,height);
-   fisheye[1].image = Create_Bitmap(width,height);
-
-   // Create output spherical (equirectangular) image
-   spherical = Create_Bitmap(params.outwidth,params.outheight);
-
    // Read parameter file name
    if (!ReadParameters(argv[argc-1])) {
       fprintf(stderr,"Failed to read parameter file \"%s\"\n",argv[argc-1]);
       exit(-1);
    }
 
-	// Apply defaults and precompute values
+	// Apply defaults and precompute values, in full size frame pixels
 	FisheyeDefaults(&fisheye[0]);
 	FisheyeDefaults(&fisheye[1]);
-	FlipFisheye(fisheye[0]);
-	FlipFisheye(fisheye[1]);
+
+	// Frames may be decoded smaller, from here on the sizes are as decoded
+	n = DecodeScale(width,height);
+	width /= n;
+	height /= n;
+	for (j=0;j<2;j++) {
+		fisheye[j].scale = n;
+		fisheye[j].width = width;
+		fisheye[j].height = height;
+	}
+	if (params.debug && n > 1)
+		fprintf(stderr,"%s() - Decoding frames at 1/%d size, %d x %d\n",argv[0],n,width,height);
+
+	if ((uint64_t)width * LevelRow(params.mip+1,height) > UINT32_MAX) {
+		fprintf(stderr,"%s() - Frames too large for the lookup table\n",argv[0]);
+		exit(-1);
+	}
+	LimitKernels((uint64_t)width * LevelRow(params.mip+1,height));
+
+   // Memory for images, stored one after the other so table offsets address both,
+	// followed by the pyramid if there is one
+   fisheye[0].image = Create_Bitmap(width,LevelRow(params.mip+1,height));
+   fisheye[1].image = fisheye[0].image + width*height;
 
 	// Create output spherical (equirectangular) image
 	spherical = Create_Bitmap(params.outwidth,params.outheight);
@@ -268,160 +2487,177 @@ int startDirectoryExtraction(int argc, char **argv, char *front, char *back, cha
 		params.blendwidth = 3*DTOR;
 	}
 
+	// Per pixel sample counts are stored in a byte
+	if (params.antialias > MAXANTIALIAS) {
+		fprintf(stderr,"Warning: Antialiasing limited to %d in batch mode\n",MAXANTIALIAS);
+		params.antialias = MAXANTIALIAS;
+	}
+	if (params.ewa) { // The taps are whole pixels, footprints are centered on an even supersample
+		params.filter = NEAREST;
+		if (params.antialias % 2 != 0)
+			params.antialias += (params.antialias < MAXANTIALIAS) ? 1 : -1;
+	}
 
+	// Directions of the output supersamples
+	if (!MakeRays()) {
+		fprintf(stderr,"%s() - Failed to allocate ray tables\n",argv[0]);
+		exit(-1);
+	}
+	if (params.verify)
+		exit(VerifyProjection() ? 0 : -1);
+	MakeFilter();
+	if (!MakePolarRows()) {
+		fprintf(stderr,"%s() - Failed to allocate polar rows\n",argv[0]);
+		exit(-1);
+	}
+	if (params.debug && params.polar > 0) {
+		for (j=0,n=0;j<params.outheight;j++)
+			n += (polar.level[j] > 0);
+		fprintf(stderr,"%s() - %d of %d rows at reduced width\n",argv[0],n,params.outheight);
+	}
 
 	if (params.debug)
 		DumpParameters();
 
-	ntable = params.outheight * params.outwidth * params.antialias * params.antialias * 2;
-	lltable = malloc(ntable*sizeof(LLTABLE));
-	sprintf(tablename,"f_%d_%d_%d_%d.data",whichtemplate,params.outwidth,params.outheight,params.antialias);
+	memset(&lut,0,sizeof(LUTFILE));
+	if (params.meshtolerance > 0) {
 
-	if ((fptr = fopen(tablename,"r")) != NULL) {
-		if (params.debug)
-			fprintf(stderr,"%s() - Reading lookup table\n",argv[0]);
-		if ((nt = fread(lltable,sizeof(LLTABLE),ntable,fptr)) != ntable) {
-			fprintf(stderr,"%s() - Failed to read lookup table \"%s\" (%d != %d)\n",argv[0],tablename,nt,ntable);
+		// Mesh remap instead of a lookup table
+		starttime = GetTime();
+		if (!BuildMesh(&mesh,width,height)) {
+			fprintf(stderr,"%s() - Failed to allocate mesh\n",argv[0]);
+			exit(-1);
 		}
-		fclose(fptr);
-	}
+		if (params.debug)
+			fprintf(stderr,"%s() - Mesh of %d cells, %.1lf MB, built in %.2lf seconds\n",argv[0],
+				mesh.ncell,mesh.ncell*sizeof(MESHCELL)/(1024.0*1024.0),GetTime()-starttime);
+	} else {
+
+		// Lookup table, reuse a previously built one if it matches the current parameters
+		LUT_InitHeader(&header);
+		header.whichtemplate = whichtemplate;
+		header.srcwidth = width;
+		header.srcheight = height;
+		header.outwidth = params.outwidth;
+		header.outheight = params.outheight;
+		header.antialias = params.antialias;
+		header.paramhash = TableHash();
+		header.tilewidth = MIN(TILEWIDTH,params.outwidth);
+		header.tileheight = MIN(TILEHEIGHT,params.outheight);
+		header.filter = params.filter;
+		header.adaptive = params.adaptive;
+		header.mip = params.mip;
+		header.ewa = params.ewa;
+		if (!LUT_CacheName(params.cachedir,&header,tablename))
+			exit(-1);
 
-	dx = params.antialias * params.outwidth;
-	dy = params.antialias * params.outheight;
+		if (LUT_Open(tablename,&header,&lut,params.verifytable)) {
+			LUT_CacheTouch(tablename);
+			if (MapLookupTable(&lut,&table)) {
+				if (params.debug)
+					fprintf(stderr,"%s() - Mapped lookup table \"%s\"\n",argv[0],tablename);
+			} else {
+				fprintf(stderr,"%s() - Lookup table \"%s\" has unexpected layout\n",argv[0],tablename);
+				LUT_Close(&lut);
+			}
+		}
 
-	if (nt != ntable) {
-		itable = 0;
+		if (lut.base == NULL && params.lazytable) {
 
-		for (j=0;j<params.outheight;j++) {
-			latitude0 = PI * j / (double)params.outheight - PID2; // -pi/2 ... pi/2
-			for (i=0;i<params.outwidth;i++) {
-				longitude0 = TWOPI * i / (double)params.outwidth - PI; // -pi ... pi
-				for (ai=0;ai<params.antialias;ai++) {
-					longitude = longitude0 + ai * TWOPI / dx;
-					for (aj=0;aj<params.antialias;aj++) {
-						latitude = latitude0 + aj * M_PI / dy;
-						for (n=0;n<2;n++) {
-							if(FindFishPixelBatch(n,latitude,longitude,&(lltable[itable].uv), width, height)) {
-								itable++;
-							}
-						}
-					} // aj
-				} // ai
-				lltable[itable].uv.index = -1;
-				itable++;
-			} // i
-		} // j
+			// Build in the background while the first frame is decoded, render claims the rest
+			if (params.debug)
+				fprintf(stderr,"%s() - Building lookup table during the first frame\n",argv[0]);
+			if (!StartLookupTable(&build,&table,width,height)) {
+				fprintf(stderr,"%s() - Failed to allocate lookup table\n",argv[0]);
+				exit(-1);
+			}
+			build.fname = tablename;
+			build.header = &header;
+			lazy = &build;
+		} else if (lut.base == NULL) {
+			if (params.debug)
+				fprintf(stderr,"%s() - Building lookup table\n",argv[0]);
+			starttime = GetTime();
+			if (!BuildLookupTable(&table,width,height)) {
+				fprintf(stderr,"%s() - Failed to allocate lookup table\n",argv[0]);
+				exit(-1);
+			}
+			if (params.debug)
+				fprintf(stderr,"%s() - Lookup table of %llu samples built in %.2lf seconds\n",argv[0],
+					(unsigned long long)table.nsample,GetTime()-starttime);
 
-		fptr = fopen(tablename,"w");
-		fwrite(lltable,ntable,sizeof(LLTABLE),fptr);
-		fclose(fptr);
+			// Save for next time, a failure here only costs a rebuild next run
+			if (SaveLookupTable(tablename,&header,&table))
+				LUT_CacheEvict(params.cachedir,params.cachesize*1024*1024,tablename);
+		}
+		if (params.debug && lazy == NULL) {
+			TableFootprint(&table,&mean,&largest);
+			fprintf(stderr,"%s() - %d tiles of %dx%d, source footprint %.0lf KB mean, %.0lf KB largest\n",argv[0],
+				table.ntile,table.tilewidth,table.tileheight,mean,largest);
+		}
+	}
 
+	// One decoder for each camera and the encoders, kept for all the frames
+	decoder[0] = JPEG_NewDecoder();
+	decoder[1] = JPEG_NewDecoder();
+	if (decoder[0] == NULL || decoder[1] == NULL ||
+		!NewStripEncoder(&encoder,params.outwidth,params.outheight,params.nthreads)) {
+		fprintf(stderr,"%s() - Failed to create the JPEG decoders\n",argv[0]);
+		exit(-1);
 	}
 
+	// Each pair is decoded into one of two buffers while the pair before is
+	// rendered, with one thread they are decoded in turn into the one buffer
+	memset(frame,0,2*sizeof(FRAMEJOB));
+	for (j=0;j<2;j++)
+		frame[j].decoder = decoder;
+	frame[0].image = fisheye[0].image;
+	frame[1].image = fisheye[0].image;
+	if (nstop > nstart && params.nthreads > 1)
+		frame[1].image = Create_Bitmap(width,LevelRow(params.mip+1,height));
+	StartFrames(&frame[0],front,back,nstart);
+
 	for (nframe=nstart;nframe<=nstop;nframe++) {
 
-		sprintf(fisheye[0].fname,front,nframe);
-		sprintf(fisheye[1].fname,back,nframe);
+		job = &frame[(nframe-nstart)%2];
+		n = FinishFrames(job);
+		if (nframe < nstop)
+			StartFrames(&frame[(nframe-nstart+1)%2],front,back,nframe+1);
+		if (!n)
+			continue;
+		strcpy(fisheye[0].fname,job->fname[0]);
+		strcpy(fisheye[1].fname,job->fname[1]);
+		fisheye[0].image = job->image;
+		fisheye[1].image = job->image + width*height;
 
 		sprintf(fnameout,out,nframe);
 
-		if (IsJPEG(fisheye[0].fname)){
-			if(1 != readJPGFast(&fisheye[0])){
-				continue;
-			}
-		}
-		if (IsJPEG(fisheye[1].fname)){
-			if(1 != readJPGFast(&fisheye[1])){
-				continue;
+		starttime = GetTime();
+		if (params.mip > 0 && params.meshtolerance <= 0)
+			MakePyramid(fisheye[0].image,width,height,params.mip);
+		if (params.meshtolerance > 0)
+			RenderMesh(&mesh,fisheye[0].image,spherical);
+		else
+			RenderLookupTable(&table,lazy,fisheye[0].image,spherical);
+		if (params.debug)
+			fprintf(stderr,"%s() - Frame %d rendered in %.3lf seconds\n",argv[0],nframe,GetTime()-starttime);
+		if (params.benchmark > 0 && nframe == nstart && params.meshtolerance <= 0 && table.filter == NEAREST)
+			BenchmarkKernels(&table,lazy,fisheye[0].image,spherical);
+		if (params.benchmark > 0 && nframe == nstart)
+			BenchmarkEncoder(&encoder,spherical);
+
+		// The first render completes a lazy build, save the table without holding up the next frame
+		if (lazy != NULL && !lazy->saving) {
+			if (!FinishLookupTable(lazy)) {
+				fprintf(stderr,"%s() - Failed to allocate lookup table\n",argv[0]);
+				exit(-1);
 			}
+			if (pthread_create(&lazy->saver,NULL,SaveLookupThread,lazy) == 0)
+				lazy->saving = TRUE;
 		}
-		
-		itable = 0;
-		Erase_Bitmap(spherical,params.outwidth,params.outheight,black);
-
-		for (j=0;j<params.outheight;j++) {
-			latitude0 = PI * j / (double)params.outheight - PID2; // -pi/2 ... pi/2
-			for (i=0;i<params.outwidth;i++) {
-				longitude0 = TWOPI * i / (double)params.outwidth - PI; // -pi ... pi
-
-				// Blending masks, only depend on longitude
-				if (params.blendwidth > 0) {
-					blend = (params.blendmid + params.blendwidth - fabs(longitude0)) / (2*params.blendwidth); // 0 ... 1
-					if (blend < 0) blend = 0;
-					if (blend > 1) blend = 1;
-					if (params.blendpower > 1) {
-							blend = 2 * blend - 1; // -1 to 1
-						blend = 0.5 + 0.5 * SIGN(blend) * pow(fabs(blend),1.0/params.blendpower);
-						}
-				} else { // No blend
-					blend = 0;
-					if (ABS(longitude0) <= params.blendmid) // Hard edge
-						blend = 1;
-				}
-		
-				// Are we in the blending zones
-				inblendzone = FALSE;
-				if (longitude0 <= params.blendmid + params.blendwidth && longitude0 >= params.blendmid - params.blendwidth)
-					inblendzone = TRUE;
-				if (longitude0 >= -params.blendmid - params.blendwidth && longitude0 <= -params.blendmid + params.blendwidth)
-					inblendzone = TRUE;
-
-
-				//printf("\n %lf, %lf, %lf\n", params.blendwidth, params.blendmid, params.blendpower);// 0.000000, 1.570796, 1.000000
-
-				// Initialise antialiasing accumulation variables
-				for (n=0;n<2;n++) {
-					rgbsum[n] = rgbzero;
-					nantialias[n] = 0;
-				}
-
-				for (n=0;n<100;n++) {
-					nn = 0;
-					index = lltable[itable].uv.index;
-					if(index == -1){
-						itable++;
-						break;
-					}
-					nn = index%10;
-					index = index/10;
-					//if(nn == 0){printf("\nnn: %d, index: %d, itable: %d\n", nn, index, itable);}
-					
-					rgbsum[nn].r += fisheye[nn].image[index].r;
-					rgbsum[nn].g += fisheye[nn].image[index].g;
-					rgbsum[nn].b += fisheye[nn].image[index].b;
-					nantialias[nn]++;
-
-					itable++;
-				}
-
-
-				// Normalise by antialiasing samples
-				for (n=0;n<2;n++) {
-					if (nantialias[n] > 0) {
-						rgbsum[n].r /= nantialias[n];
-						rgbsum[n].g /= nantialias[n];
-						rgbsum[n].b /= nantialias[n];
-					}
-				}
-
-				index = j * params.outwidth + i;
-				spherical[index].r = blend * rgbsum[0].r + (1 - blend) * rgbsum[1].r;
-	        	spherical[index].g = blend * rgbsum[0].g + (1 - blend) * rgbsum[1].g;
-	        	spherical[index].b = blend * rgbsum[0].b + (1 - blend) * rgbsum[1].b;
-				//printf("%d ", index);
-
-				//printf("\nindex: %d, r: %d, g: %d, b: %d\n", index, spherical[index].r, spherical[index].g, spherical[index].b);
-
-				//if(itable > 100){
-					//break;
-				//}
-
-			} // i
-			//break;
-		} // j
 
 		// Write out the spherical map 
-		if (!WriteOutputImageBatch(spherical, basename,fnameout)) {
+		if (!WriteOutputImageBatch(spherical, basename,fnameout,&encoder)) {
 			fprintf(stderr,"Failed to write output image file\n");
 			exit(-1);
 		}
@@ -431,21 +2667,37 @@ int startDirectoryExtraction(int argc, char **argv, char *front, char *back, cha
 		if (params.makeremap)
 			MakeRemap();
 	Destroy_Bitmap(spherical);
-	Destroy_Bitmap(fisheye[0].image);
-	Destroy_Bitmap(fisheye[1].image);
+	if (frame[1].image != frame[0].image)
+		Destroy_Bitmap(frame[1].image);
+	Destroy_Bitmap(frame[0].image);
+	if (params.meshtolerance > 0)
+		FreeMesh(&mesh);
+	else if (lazy != NULL)
+		FreeLazyTable(lazy);
+	else if (lut.base != NULL)
+		LUT_Close(&lut);
+	else
+		FreeLookupTable(&table);
+	FreeRays();
+	FreePolarRows();
+	JPEG_FreeDecoder(decoder[0]);
+	JPEG_FreeDecoder(decoder[1]);
+	FreeStripEncoder(&encoder);
 
     return 0;
 }
 
 int main(int argc,char **argv)
 {
-	int i,j,aj,ai,n=0, sdir=0, nstart=0, nstop=0,ix,iy;
-	int index,nantialias[2],inblendzone;
+	int i,j,aj,ai,n=0, sdir=0, nstart=0, nstop=0,ix,iy,is;
+	int index,nantialias[2],inblendzone,factor,z;
 	char basename[256],outfilename[256] = "\0";
-	BITMAP4 black = {0,0,0,255},red = {255,0,0,255};
-	double latitude0,longitude0,latitude,longitude;
+	BITMAP4 black = {0,0,0,255},red = {255,0,0,255},*reduced;
+	double longitude0;
+	float *rowu[2],*rowv[2];
 	double weight = 1,blend = 1;
 	COLOUR rgb,rgbsum[2],rgbzero = {0,0,0};
+	ZONESPAN *span;
 	double starttime=0,stoptime=0;
 	int nopt,noptiterations = 1; // > 1 for optimisation
 	double fov[2];
@@ -453,7 +2705,7 @@ int main(int argc,char **argv)
 	double r,theta,minerror=1e32,opterror=0,errorsum = 0;
 	int nsave = 0;
 	char fname[256], front[256], back[256];
-	int nfish = 0;
+	int nfish = 0,nread[2];
 	FILE *fptr;
 
 	// Initial values for fisheye structure and general parameters
@@ -483,6 +2735,20 @@ int main(int argc,char **argv)
 			i++;
 			if ((params.antialias = atoi(argv[i])) < 1)
 				params.antialias = 1;
+		} else if (strcmp(argv[i],"-A") == 0) {
+			params.adaptive = TRUE;
+		} else if (strcmp(argv[i],"-L") == 0) {
+			i++;
+			if ((params.mip = atoi(argv[i])) < 0)
+				params.mip = 0;
+		} else if (strcmp(argv[i],"-E") == 0) {
+			params.ewa = TRUE;
+		} else if (strcmp(argv[i],"-D") == 0) {
+			params.decodescale = TRUE;
+		} else if (strcmp(argv[i],"-P") == 0) {
+			i++;
+			if ((params.polar = DTOR*atof(argv[i])) < 0)
+				params.polar = 0;
 		} else if (strcmp(argv[i],"-b") == 0) {
          i++;
          if ((params.blendwidth = DTOR*atof(argv[i])) < 0)
@@ -499,21 +2765,13 @@ int main(int argc,char **argv)
 		} else if (strcmp(argv[i],"-f") == 0) {
 			i++;
 			strcpy(fisheye[0].fname,argv[i]);
-			if (IsJPEG(fisheye[0].fname)){
-				if(1 != readJPG(&fisheye[0])){
-					exit(-1);
-				}
+			if (IsJPEG(fisheye[0].fname))
 				nfish +=1;
-			}
 			
 			i++;
 			strcpy(fisheye[1].fname,argv[i]);
-			if (IsJPEG(fisheye[1].fname)){
-				if(1 != readJPG(&fisheye[1])){
-					exit(-1);
-				}
+			if (IsJPEG(fisheye[1].fname))
 				nfish +=1;
-			}
 			if(nfish == 2){
 				params.fileformat = JPG;
 			}
@@ -552,14 +2810,80 @@ int main(int argc,char **argv)
       } else if (strcmp(argv[i],"-h") == 0) {
 		i++;
 		nstop = atoi(argv[i]);
+      } else if (strcmp(argv[i],"-t") == 0) {
+		i++;
+		if ((params.nthreads = atoi(argv[i])) < 1)
+			params.nthreads = 1;
+      } else if (strcmp(argv[i],"-M") == 0) {
+		i++;
+		if ((params.meshtolerance = atof(argv[i])) < 0)
+			params.meshtolerance = 0;
+      } else if (strcmp(argv[i],"-V") == 0) {
+			params.verify = TRUE;
+      } else if (strcmp(argv[i],"-l") == 0) {
+			params.lazytable = TRUE;
+      } else if (strcmp(argv[i],"-v") == 0) {
+			params.verifytable = TRUE;
+      } else if (strcmp(argv[i],"-B") == 0) {
+		i++;
+		if ((params.benchmark = atoi(argv[i])) < 0)
+			params.benchmark = 0;
+      } else if (strcmp(argv[i],"-K") == 0) {
+		i++;
+		strncpy(params.kernel,argv[i],sizeof(params.kernel)-1);
+      } else if (strcmp(argv[i],"-s") == 0) {
+		i++;
+		params.filter = atoi(argv[i]);
+		if (params.filter < NEAREST || params.filter > BICUBIC)
+			params.filter = NEAREST;
+      } else if (strcmp(argv[i],"-c") == 0) {
+		i++;
+		strcpy(params.cachedir,argv[i]);
+      } else if (strcmp(argv[i],"-k") == 0) {
+		i++;
+		if ((params.cachesize = atof(argv[i])) < 0)
+			params.cachesize = 0;
+      } else if (strcmp(argv[i],"-Q") == 0) {
+		i++;
+		params.quality = atoi(argv[i]);
+		params.quality = MAX(1,MIN(100,params.quality));
+      } else if (strcmp(argv[i],"-S") == 0) {
+		i++;
+		if (strcmp(argv[i],"444") == 0)
+			params.subsample = JPEG_SUB444;
+		else if (strcmp(argv[i],"422") == 0)
+			params.subsample = JPEG_SUB422;
+		else
+			params.subsample = JPEG_SUB420;
+      } else if (strcmp(argv[i],"-C") == 0) {
+		i++;
+		if (strcmp(argv[i],"ifast") == 0)
+			params.dctmethod = JDCT_IFAST;
+		else if (strcmp(argv[i],"float") == 0)
+			params.dctmethod = JDCT_FLOAT;
+		else
+			params.dctmethod = JDCT_ISLOW;
 	  }
 	}
 
+	// Kernel variants for this CPU
+	if (!SelectKernels(params.kernel))
+		exit(-1);
+	if (params.debug)
+		fprintf(stderr,"Using the %s kernels\n",kernel.name);
+
     if(sdir == 1){
         startDirectoryExtraction(argc, argv, front, back, outfilename, nstart, nstop);
         exit(0);
     }
 
+	// Read the -f images, both at once
+	if (nfish == 2) {
+		ParallelRows(2,1,ReadFrames,nread);
+		if (!nread[0] || !nread[1])
+			exit(-1);
+	}
+
    // Read parameter file name
    if (!ReadParameters(argv[argc-1])) {
       fprintf(stderr,"Failed to read parameter file \"%s\"\n",argv[argc-1]);
@@ -569,18 +2893,51 @@ int main(int argc,char **argv)
 	// Apply defaults and precompute values
 	FisheyeDefaults(&fisheye[0]);
 	FisheyeDefaults(&fisheye[1]);
-	FlipFisheye(fisheye[0]);
-	FlipFisheye(fisheye[1]);
 
    // Create output spherical (equirectangular) image
    spherical = Create_Bitmap(params.outwidth,params.outheight);
 
+	// Directions of the output supersamples
+	if (!MakeRays()) {
+		fprintf(stderr,"Failed to allocate ray tables\n");
+		exit(-1);
+	}
+	if (params.verify)
+		exit(VerifyProjection() ? 0 : -1);
+	MakeFilter();
+	for (n=0;n<2;n++) {
+		rowu[n] = malloc(2*params.antialias*rays.nlongitude*sizeof(float));
+		if (rowu[n] == NULL) {
+			fprintf(stderr,"Failed to allocate ray buffers\n");
+			exit(-1);
+		}
+		rowv[n] = rowu[n] + params.antialias*rays.nlongitude;
+	}
+	reduced = malloc((params.outwidth/2+2)*sizeof(BITMAP4));
+	if (!MakePolarRows() || reduced == NULL) {
+		fprintf(stderr,"Failed to allocate polar rows\n");
+		exit(-1);
+	}
+
 	// Must have blending on for optimisation
 	if (noptiterations > 1 && params.blendwidth <= 0) {
 		fprintf(stderr,"Warning: Must enable blending for optimisation, setting to 6 degrees\n");
 		params.blendwidth = 3*DTOR;
 	}
 
+	// Optimisation compares the cameras, so then every pixel is blended
+	if (!MakeZones(noptiterations == 1)) {
+		fprintf(stderr,"Failed to allocate zones\n");
+		exit(-1);
+	}
+	if (params.debug) {
+		for (i=0,j=0;i<zones.nspan[0];i++) {
+			if (zones.span[0][i].zone != ZONEOVERLAP)
+				j += zones.span[0][i].stop - zones.span[0][i].start;
+		}
+		fprintf(stderr,"%d of %d columns from a single camera\n",j,params.outwidth);
+	}
+
 	// Remember the baseline values
 	for (j=0;j<2;j++) {
 		fov[j]     = fisheye[j].fov;
@@ -616,87 +2973,110 @@ int main(int argc,char **argv)
 		starttime = GetTime();
 		Erase_Bitmap(spherical,params.outwidth,params.outheight,black);
       for (j=0;j<params.outheight;j++) {
-         latitude0 = PI * j / (double)params.outheight - PID2; // -pi/2 ... pi/2
 
-			for (i=0;i<params.outwidth;i++) {
-				longitude0 = TWOPI * i / (double)params.outwidth - PI; // -pi ... pi
-	
-		      // Blending masks, only depend on longitude
-		      if (params.blendwidth > 0) {
-		         blend = (params.blendmid + params.blendwidth - fabs(longitude0)) / (2*params.blendwidth); // 0 ... 1
-		         if (blend < 0) blend = 0;
-		         if (blend > 1) blend = 1;
-		         if (params.blendpower > 1) {
-						blend = 2 * blend - 1; // -1 to 1
-		            blend = 0.5 + 0.5 * SIGN(blend) * pow(fabs(blend),1.0/params.blendpower);
-					}
-		      } else { // No blend
-		         blend = 0;
-		         if (ABS(longitude0) <= params.blendmid) // Hard edge
-		            blend = 1;
-		      }
-	
-            // Are we in the blending zones
-            inblendzone = FALSE;
-            if (longitude0 <= params.blendmid + params.blendwidth && longitude0 >= params.blendmid - params.blendwidth)
-               inblendzone = TRUE;
-            if (longitude0 >= -params.blendmid - params.blendwidth && longitude0 <= -params.blendmid + params.blendwidth)
-               inblendzone = TRUE;
-  
-            // If optimising then only need to calculate image within the blend zone
-            if (noptiterations > 1 && !inblendzone)
-               continue;
+			// Reduced rows sample every factor'th pixel over factor columns, stored packed, see MakePolarRows()
+			factor = 1 << polar.level[j];
+			for (z=0;z<zones.nspan[polar.level[j]];z++) {
+				span = &zones.span[polar.level[j]][z];
 
-				// Initialise antialiasing accumulation variables
+				// Fisheye coordinates of the span's supersamples, from the cameras it uses
+				is = span->start * params.antialias;
 				for (n=0;n<2;n++) {
-					rgbsum[n] = rgbzero;
-					nantialias[n] = 0;
+					if (span->zone != ZONEOVERLAP && span->zone != n)
+						continue;
+					for (aj=0;aj<params.antialias;aj++)
+						kernel.projectrays(n,j*params.antialias+aj,is,(span->stop-span->start)*params.antialias,
+							rowu[n]+aj*rays.nlongitude+is,rowv[n]+aj*rays.nlongitude+is);
 				}
+
+				// Single camera spans need no blending
+				if (span->zone != ZONEOVERLAP) {
+					RenderCameraSpan(span->zone,span,j,rowu[span->zone],rowv[span->zone],spherical);
+					continue;
+				}
+
+				for (i=span->start;i<span->stop;i+=factor) {
+					longitude0 = TWOPI * i / (double)params.outwidth - PI; // -pi ... pi
 	
-				// Antialiasing, inner loops
-            // Find the corresponding pixel in the fisheye image
-            // Sum over the supersampling set
-	   		for (ai=0;ai<params.antialias;ai++) {
-					longitude = longitude0 + ai * TWOPI / (params.antialias*params.outwidth);
-	      		for (aj=0;aj<params.antialias;aj++) {
-						latitude = latitude0 + aj * M_PI / (params.antialias*params.outheight);
-						for (n=0;n<2;n++) {
-							if (FindFishPixel(n,latitude,longitude,&ix,&iy,&rgb)) {
-								rgbsum[n].r += rgb.r;
-		               	rgbsum[n].g += rgb.g;
-		               	rgbsum[n].b += rgb.b;
-								nantialias[n]++;	
-							}
+			      // Blending masks, only depend on longitude
+			      if (params.blendwidth > 0) {
+			         blend = (params.blendmid + params.blendwidth - fabs(longitude0)) / (2*params.blendwidth); // 0 ... 1
+			         if (blend < 0) blend = 0;
+			         if (blend > 1) blend = 1;
+			         if (params.blendpower > 1) {
+							blend = 2 * blend - 1; // -1 to 1
+			            blend = 0.5 + 0.5 * SIGN(blend) * pow(fabs(blend),1.0/params.blendpower);
 						}
-					} // aj
-				} // ai
+			      } else { // No blend
+			         blend = 0;
+			         if (ABS(longitude0) <= params.blendmid) // Hard edge
+			            blend = 1;
+			      }
 	
-				// Normalise by antialiasing samples
-				for (n=0;n<2;n++) {
-					if (nantialias[n] > 0) {
-						rgbsum[n].r /= nantialias[n];
-	               rgbsum[n].g /= nantialias[n];
-	               rgbsum[n].b /= nantialias[n];
+	            // Are we in the blending zones
+	            inblendzone = FALSE;
+	            if (longitude0 <= params.blendmid + params.blendwidth && longitude0 >= params.blendmid - params.blendwidth)
+	               inblendzone = TRUE;
+	            if (longitude0 >= -params.blendmid - params.blendwidth && longitude0 <= -params.blendmid + params.blendwidth)
+	               inblendzone = TRUE;
+  
+	            // If optimising then only need to calculate image within the blend zone
+	            if (noptiterations > 1 && !inblendzone)
+	               continue;
+
+					// Initialise antialiasing accumulation variables
+					for (n=0;n<2;n++) {
+						rgbsum[n] = rgbzero;
+						nantialias[n] = 0;
 					}
-				}
 	
-				// Update antialiased value to final image with blending
-				index = j * params.outwidth + i;
-				spherical[index].r = blend * rgbsum[0].r + (1 - blend) * rgbsum[1].r;
-	        	spherical[index].g = blend * rgbsum[0].g + (1 - blend) * rgbsum[1].g;
-	        	spherical[index].b = blend * rgbsum[0].b + (1 - blend) * rgbsum[1].b;
+					// Antialiasing, inner loops
+	            // Find the corresponding pixel in the fisheye image
+	            // Sum over the supersampling set
+		   		for (ai=0;ai<params.antialias;ai++) {
+						is = i * params.antialias + factor * ai;
+		      		for (aj=0;aj<params.antialias;aj++) {
+							for (n=0;n<2;n++) {
+								if (!InBlendRange(n,rays.longitude[is]))
+									continue;
+								if (FishPixel(n,rowu[n][aj*rays.nlongitude+is],rowv[n][aj*rays.nlongitude+is],&ix,&iy,&rgb)) {
+									rgbsum[n].r += rgb.r;
+			               	rgbsum[n].g += rgb.g;
+			               	rgbsum[n].b += rgb.b;
+									nantialias[n]++;	
+								}
+							}
+						} // aj
+					} // ai
 	
-				// Determine error metric if in optimisation mode
-				// Experimental, weight higher if closer to the center of blend
-				if (noptiterations > 1 && inblendzone) {
-					//weight = 1;
-					weight = 1 - 2 * fabs(0.5 - blend); // 0 to 1 in middle of blend to 0
-					if (j > 0.2*params.outheight && j < 0.8*params.outheight) {
-						opterror += CalcError(rgbsum[0],rgbsum[1],weight);
-						errorsum += weight;
+					// Normalise by antialiasing samples
+					for (n=0;n<2;n++) {
+						if (nantialias[n] > 0) {
+							rgbsum[n].r /= nantialias[n];
+		               rgbsum[n].g /= nantialias[n];
+		               rgbsum[n].b /= nantialias[n];
+						}
 					}
-				}
-			} // i
+	
+					// Update antialiased value to final image with blending
+					index = j * params.outwidth + PolarColumn(i / factor,polar.level[j]);
+					spherical[index].r = blend * rgbsum[0].r + (1 - blend) * rgbsum[1].r;
+		        	spherical[index].g = blend * rgbsum[0].g + (1 - blend) * rgbsum[1].g;
+		        	spherical[index].b = blend * rgbsum[0].b + (1 - blend) * rgbsum[1].b;
+	
+					// Determine error metric if in optimisation mode
+					// Experimental, weight higher if closer to the center of blend
+					if (noptiterations > 1 && inblendzone) {
+						//weight = 1;
+						weight = 1 - 2 * fabs(0.5 - blend); // 0 to 1 in middle of blend to 0
+						if (j > 0.2*params.outheight && j < 0.8*params.outheight) {
+							opterror += CalcError(rgbsum[0],rgbsum[1],weight);
+							errorsum += weight;
+						}
+					}
+				} // i
+			} // z
+			ExpandPolarRow(spherical,reduced,j);
 		} // j
 		stoptime = GetTime();
 	
@@ -790,6 +3170,12 @@ void GiveUsage(char *s)
    fprintf(stderr,"Options\n");
    fprintf(stderr,"   -w n      sets the output image size, default: %d\n",params.outwidth);
    fprintf(stderr,"   -a n      sets antialiasing level, default: %d\n",params.antialias);
+	fprintf(stderr,"   -A        for -x antialias adaptively, up to the -a level where the source is minified, default: off\n");
+	fprintf(stderr,"   -E        for -x filter each pixel's footprint with elliptical weighted average taps, default: off\n");
+	fprintf(stderr,"   -P n      sample rows further than n degrees from the equator at reduced width, default: off\n");
+	fprintf(stderr,"   -D        for -x decode frames at 1/2, 1/4 or 1/8 size where the output is small enough, default: off\n");
+	fprintf(stderr,"   -L n      for -x sample a source pyramid of up to n half size levels where it is minified, default: off\n");
+	fprintf(stderr,"   -s n      source sampling, 0 nearest, 1 bilinear, 2 bicubic, default: %d\n",params.filter);
 	fprintf(stderr,"   -b n      longitude width for blending, default: %g\n",2*params.blendwidth);
 	fprintf(stderr,"   -q n      blend power, default: %g\n",params.blendpower);
 	fprintf(stderr,"   -e n      optimise over n random steps, default: off\n");
@@ -801,6 +3187,18 @@ void GiveUsage(char *s)
 	fprintf(stderr,"   -m n      specify blend mid angle, default: %g\n",RTOD*2*params.blendmid);
 	fprintf(stderr,"   -d        debug mode, default: off\n");
 	fprintf(stderr,"   -r        create remap filters for ffmpeg, default: off\n");
+	fprintf(stderr,"   -V        check the vectorised projection against the scalar code and exit\n");
+	fprintf(stderr,"   -t n      number of threads, default: %d\n",params.nthreads);
+	fprintf(stderr,"   -M n      for -x use a mesh remap with n pixels maximum error, default: off\n");
+	fprintf(stderr,"   -l        for -x build a missing lookup table during the first frame, default: off\n");
+	fprintf(stderr,"   -v        for -x verify the checksum of a cached lookup table before using it, default: off\n");
+	fprintf(stderr,"   -B n      for -x time each kernel variant and the encoder over n runs on the first frame, default: off\n");
+	fprintf(stderr,"   -K s      use this kernel variant, scalar, avx2 or avx512, default: best the CPU supports\n");
+	fprintf(stderr,"   -c s      lookup table cache directory for -x, default: %s\n",params.cachedir);
+	fprintf(stderr,"   -k n      lookup table cache limit in MB, 0 is no limit, default: %g\n",params.cachesize);
+	fprintf(stderr,"   -Q n      JPEG output quality, 1 to 100, default: %d\n",params.quality);
+	fprintf(stderr,"   -S s      JPEG output chroma subsampling, 444, 422 or 420, default: 420\n");
+	fprintf(stderr,"   -C s      JPEG output DCT method, islow, ifast or float, default: islow\n");
    exit(-1);
 }
 
@@ -819,6 +3217,7 @@ void InitFisheye(FISHEYE *f)
    f->fov = 180;
 	f->hflip = 1;
 	f->vflip = 1;
+	f->scale = 1;
    f->transform = NULL;
    f->ntransform = 0;
 }
@@ -852,79 +3251,123 @@ void FisheyeDefaults(FISHEYE *f)
       f->transform[j].cvalue = cos(f->transform[j].value);
       f->transform[j].svalue = sin(f->transform[j].value);
    }
+	MakeRotation(f);
+}
+
+/*
+	Compose the fisheye correction transforms, in the order given, into a single
+	rotation matrix so a ray is corrected with one matrix vector multiply.
+	HFLIP and VFLIP are folded in as a reflection across and down the image,
+	with FishCenter() this mirrors the image about the center pixel.
+	Must be called again whenever the transforms change.
+*/
+void MakeRotation(FISHEYE *f)
+{
+	int i,j,k,l;
+	double c,s,r[3][3],m[3][3];
+
+	for (i=0;i<3;i++)
+		for (j=0;j<3;j++)
+			f->rotate[i][j] = (i == j);
+
+	for (k=0;k<f->ntransform;k++) {
+		c = f->transform[k].cvalue;
+		s = f->transform[k].svalue;
+		memset(r,0,sizeof(r));
+		switch(f->transform[k].axis) {
+		case XTILT:
+			r[0][0] = 1;
+			r[1][1] = c;  r[1][2] = s;
+			r[2][1] = -s; r[2][2] = c;
+			break;
+		case YROLL:
+			r[0][0] = c;  r[0][2] = s;
+			r[1][1] = 1;
+			r[2][0] = -s; r[2][2] = c;
+			break;
+		case ZPAN:
+			r[0][0] = c;  r[0][1] = s;
+			r[1][0] = -s; r[1][1] = c;
+			r[2][2] = 1;
+			break;
+		}
+
+		// Applied after those so far
+		for (i=0;i<3;i++) {
+			for (j=0;j<3;j++) {
+				m[i][j] = 0;
+				for (l=0;l<3;l++)
+					m[i][j] += r[i][l] * f->rotate[l][j];
+			}
+		}
+		for (i=0;i<3;i++)
+			for (j=0;j<3;j++)
+				f->rotate[i][j] = m[i][j];
+	}
+
+	// HFLIP and VFLIP, hflip and vflip are 1 or -1
+	for (j=0;j<3;j++) {
+		f->rotate[0][j] *= f->hflip;
+		f->rotate[2][j] *= f->vflip;
+	}
 }
 
 
 /*
-   Given a longitude and latitude calculate the rgb value from the fisheye
+   Given supersample column is and row js calculate the rgb value from the fisheye
+   Scalar version, whole rows are projected with ProjectRays()
    Return FALSE if the pixel is outside the fisheye image
 */
-int FindFishPixel(int n,double latitude,double longitude,int *u,int *v,COLOUR *rgb)
+int FindFishPixel(int n,int is,int js,int *u,int *v,COLOUR *rgb)
 {
-   int k,index;
+   XYZ p;
+   double fu,fv;
    COLOUR c = {0,0,0};
-   XYZ p,q = {0,0,0};
-   double theta,phi,r;
 
 	*u = -1;
 	*v = -1;
 	*rgb = c;
 	
    // Ignore pixels that will never be touched because out of blend range
-   if (n == 0) {
-      if (longitude > params.blendmid + params.blendwidth || longitude < -params.blendmid - params.blendwidth)
-         return(FALSE);
-   }
-   if (n == 1) {
-      if (longitude > -params.blendmid + params.blendwidth && longitude < params.blendmid - params.blendwidth)
-         return(FALSE); 
-   }
-
-   // Turn by 180 degrees for the second fisheye
-   if (n == 1) {
-      longitude += M_PI;
-   }
+	if (!InBlendRange(n,rays.longitude[is]))
+		return(FALSE);
 
    // p is the ray from the camera position into the scene
-   p.x = cos(latitude) * sin(longitude);
-   p.y = cos(latitude) * cos(longitude);
-   p.z = sin(latitude);
+	SampleRay(n,is,js,&p);
 
-   // Apply fisheye correction transformation
-   for (k=0;k<fisheye[n].ntransform;k++) {
-      switch(fisheye[n].transform[k].axis) {
-      case XTILT:
-         q.x =  p.x;
-         q.y =  p.y * fisheye[n].transform[k].cvalue + p.z * fisheye[n].transform[k].svalue;
-         q.z = -p.y * fisheye[n].transform[k].svalue + p.z * fisheye[n].transform[k].cvalue;
-         break;
-      case YROLL:
-         q.x =  p.x * fisheye[n].transform[k].cvalue + p.z * fisheye[n].transform[k].svalue;
-         q.y =  p.y;
-         q.z = -p.x * fisheye[n].transform[k].svalue + p.z * fisheye[n].transform[k].cvalue;
-         break;
-      case ZPAN:
-         q.x =  p.x * fisheye[n].transform[k].cvalue + p.y * fisheye[n].transform[k].svalue;
-         q.y = -p.x * fisheye[n].transform[k].svalue + p.y * fisheye[n].transform[k].cvalue;
-         q.z =  p.z;
-         break;
-      }
-      p = q;
-   }
+   // Determine the u,v coordinate
+	RayFishCoord(n,p,&fu,&fv);
 
-   // Calculate fisheye coordinates
-   theta = atan2(p.z,p.x);
-   phi = atan2(sqrt(p.x*p.x+p.z*p.z),p.y);
-   r = phi / fisheye[n].fov; // 0 ... 1
+	return(FishPixel(n,fu,fv,u,v,rgb));
+}
 
-   // Determine the u,v coordinate
-   *u = fisheye[n].centerx + fisheye[n].radius * r * cos(theta);
+/*
+	Pixel and rgb value at fractional fisheye coordinates
+	Return FALSE if the pixel is outside the fisheye image
+*/
+int FishPixel(int n,double fu,double fv,int *u,int *v,COLOUR *rgb)
+{
+   int index;
+	uint16_t frac;
+	uint32_t offset,c[3];
+
+   *u = fu;
    if (*u < 0 || *u >= fisheye[n].width)
       return(FALSE);
-   *v = fisheye[n].centery + fisheye[n].radius * r * sin(theta);
+   *v = fv;
    if (*v < 0 || *v >= fisheye[n].height)
        return(FALSE);
 
+	// Filtered from the taps around (fu,fv)
+	if (params.filter != NEAREST) {
+		FishOffset(0,0,fu,fv,&offset,&frac,fisheye[n].width,fisheye[n].height);
+		FilterSample(fisheye[n].image,offset,frac,fisheye[n].width,FILTERTAPS,c);
+		rgb->r = c[0] / (double)FRACONE;
+		rgb->g = c[1] / (double)FRACONE;
+		rgb->b = c[2] / (double)FRACONE;
+		return(TRUE);
+	}
+
 	// Extract rgb colour
    index = (*v) * fisheye[n].width + (*u);
    rgb->r = fisheye[n].image[index].r;
@@ -1107,9 +3550,10 @@ int ReadParameters(char *s)
 
 int WriteOutputImage(char *basename,char *s)
 {
-	int i;
+	int i,status = TRUE;
 	FILE *fptr;
 	char fname[256];
+	STRIPENCODER enc;
 
 	// Decide on the name
    if (strlen(s) < 2) {
@@ -1140,13 +3584,21 @@ int WriteOutputImage(char *basename,char *s)
    }
 
 	// Write image
-   if (params.fileformat == JPG)
-      JPEG_Write(fptr,spherical,params.outwidth,params.outheight,100);
-   else
+   if (params.fileformat == JPG) {
+		if (!NewStripEncoder(&enc,params.outwidth,params.outheight,params.nthreads)) {
+			fprintf(stderr,"Failed to create the JPEG encoders\n");
+			status = FALSE;
+		} else if (!EncodeOutput(&enc,fptr,spherical)) {
+			fprintf(stderr,"Failed to write \"%s\", %s\n",fname,enc.error);
+			status = FALSE;
+		}
+		FreeStripEncoder(&enc);
+   } else {
    	Write_Bitmap(fptr,spherical,params.outwidth,params.outheight,12);
+	}
 
    fclose(fptr);
-	return(TRUE);
+	return(status);
 }
 
 /*
@@ -1224,6 +3676,7 @@ void MakeRandomRotations(void)
       fisheye[0].transform[j].cvalue = cos(fisheye[0].transform[j].value);
       fisheye[0].transform[j].svalue = sin(fisheye[0].transform[j].value);
    }
+	MakeRotation(&fisheye[0]);
 }
 
 /*
@@ -1305,6 +3758,11 @@ void InitParams(void)
 
 	params.debug = FALSE;
 	params.antialias = 2;             // Supersampling antialising
+	params.adaptive = FALSE;
+	params.mip = 0;
+	params.ewa = FALSE;
+	params.decodescale = FALSE;
+	params.polar = 0;
 	params.blendmid = 180*DTOR*0.5;   // Mid point for blending
 	params.blendwidth = 0;            // Angular blending width
 	params.blendpower = 1;
@@ -1332,6 +3790,24 @@ void InitParams(void)
 	params.deltatheta = 5*DTOR;       // Variation of rotations
 
 	params.fileformat = TGA;
+	params.quality = 100;
+	params.subsample = JPEG_SUB420;
+	params.dctmethod = JDCT_ISLOW;
+
+	// Use all the cores by default
+	if ((params.nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		params.nthreads = 1;
+
+	// Batch lookup table cache, or a mesh remap instead
+	params.meshtolerance = 0;
+	params.lazytable = FALSE;
+	params.verifytable = FALSE;
+	params.filter = NEAREST;
+	params.benchmark = 0;
+	params.kernel[0] = '\0';
+	params.verify = FALSE;
+	strcpy(params.cachedir,".");
+	params.cachesize = 0;
 
 	// Random number seed
    time(&secs);
@@ -1340,67 +3816,6 @@ void InitParams(void)
    srand48(seed);
 }
 
-void FlipFisheye(FISHEYE f)
-{
-	BITMAP4 c1,c2,black = {0,0,0};
-	int i,j,x1,y1,x2,y2;
-	int index1,index2;
-
-	if (f.hflip < 0) {
-		for (i=1;i<=f.radius;i++) {
-			for (j=-f.radius;j<=f.radius;j++) {
-				x1 = f.centerx-i;
-				y1 = f.centery+j;
-				x2 = f.centerx+i;
-      		y2 = f.centery+j;
-				index1 = y1 * f.width + x1;
-				index2 = y2 * f.width + x2;
-
-				if (x1 < 0 || y1 < 0 || x1 >= f.width || y1 >= f.height)
-					c1 = black;
-				else
-					c1 = f.image[index1];
-            if (x2 < 0 || y2 < 0 || x2 >= f.width || y2 >= f.height)
-               c2 = black;
-            else
-					c2 = f.image[index2];
-
-				if (x1 >= 0 || y1 >= 0 || x1 < f.width || y1 < f.height)
-					f.image[index1] = c2;
-				if (x2 >= 0 || y2 >= 0 || x2 < f.width || y2 < f.height)
-					f.image[index2] = c1;
-			}
-		}
-	}
-
-	if (f.vflip < 0) {
-      for (i=-f.radius;i<=f.radius;i++) {
-         for (j=1;j<=f.radius;j++) {
-            x1 = f.centerx+i;
-            y1 = f.centery-j;
-            x2 = f.centerx+i;
-            y2 = f.centery+j;
-            index1 = y1 * f.width + x1;
-            index2 = y2 * f.width + x2;
-
-            if (x1 < 0 || y1 < 0 || x1 >= f.width || y1 >= f.height)
-               c1 = black;
-            else
-               c1 = f.image[index1];
-            if (x2 < 0 || y2 < 0 || x2 >= f.width || y2 >= f.height)
-               c2 = black;
-            else
-               c2 = f.image[index2];
-
-            if (x1 >= 0 || y1 >= 0 || x1 < f.width || y1 < f.height)
-               f.image[index1] = c2;
-            if (x2 >= 0 || y2 >= 0 || x2 < f.width || y2 < f.height)
-               f.image[index2] = c1;
-         }
-      }
-	}
-}
-
 XYZ RotateX(XYZ p,double theta)
 {
    XYZ q;
@@ -1441,11 +3856,17 @@ XYZ RotateZ(XYZ p,double theta)
 */
 void MakeRemap(void)
 {
-   int i,j,ix,iy,u,v,n;
-   double longitude,latitude;
+   int i,j,ix,iy,u,v,n,is;
    char fname[256];
    FILE *fptrx = NULL,*fptry = NULL;
 	COLOUR rgb;
+	float *rowu,*rowv;
+
+	// Fisheye coordinates along a row
+	rowu = malloc(2*rays.nlongitude*sizeof(float));
+	if (rowu == NULL)
+		return;
+	rowv = rowu + rays.nlongitude;
 
 	for (n=0;n<2;n++) {
 
@@ -1458,16 +3879,14 @@ void MakeRemap(void)
    	fprintf(fptry,"P2\n%d %d\n65535\n",params.outwidth,params.outheight);
 
    	for (j=params.outheight-1;j>=0;j--) {
+			kernel.projectrays(n,j*params.antialias,0,rays.nlongitude,rowu,rowv);
    	   for (i=0;i<params.outwidth;i++) {
    	      ix = -1;
    	      iy = -1;
 	
-	         // Calculate longitude and latitude
-	         longitude = TWOPI * i / (double)params.outwidth - PI; // -pi ... pi
-	         latitude = PI * j / (double)params.outheight - PID2; // -pi/2 ... pi/2
-	
 	         // Find the corresponding pixel in the fisheye image
-	         if (FindFishPixel(n,latitude,longitude,&u,&v,&rgb)) {
+				is = i * params.antialias;
+	         if (InBlendRange(n,rays.longitude[is]) && FishPixel(n,rowu[is],rowv[is],&u,&v,&rgb)) {
 	            ix = u;
 	            iy = fisheye[n].height-1-v;
 	         }
@@ -1481,6 +3900,7 @@ void MakeRemap(void)
 	   fclose(fptry);
 
 	} // n
+	free(rowu);
 }
 
 /************ Adding fusion2spherebatch code ************/
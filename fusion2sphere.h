@@ -4,7 +4,10 @@
 #include <math.h>
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "bitmaplib.h"
+#include "lltable.h"
 #include "jpeglib.h"
 
 #define ABS(x) (x < 0 ? -(x) : (x))
@@ -13,6 +16,35 @@
 #define MAX(x,y) (x > y ? x : y)
 #define EPS 0.00001
 
+#define MAXANTIALIAS 15       // Batch lookup table sample counts are bytes
+#define WEIGHTBITS 15         // Fixed point lookup table weights
+#define WEIGHTONE (1 << WEIGHTBITS)
+
+// Source sampling, see FishOffset()
+#define NEAREST   0
+#define BILINEAR  1
+#define BICUBIC   2
+#define FRACBITS  8           // Fixed point sub pixel positions and filter weights
+#define FRACONE (1 << FRACBITS)
+#define FILTERTAPS (params.filter == BILINEAR ? 2 : 4)
+
+// Source pyramid, see MakePyramid()
+#define MAXLEVEL  6           // Most levels below the full size image
+
+// Elliptical weighted average, see EWATaps()
+#define EWATAPS   64          // Most taps per camera for one output pixel, counts are bytes
+#define EWASCALE  0.7         // Footprint semi-axes as a fraction of the Jacobian columns
+#define EWARECON  0.5         // Squared radius of the reconstruction circle, source pixels
+
+// Batch frames decoded at reduced size, see DecodeScale()
+#define DECODEDENSITY 0.9     // Least decoded fisheye pixels per output pixel across the equator
+
+// Output encoded in strips by the worker threads, see NewStripEncoder()
+#define JPEGSTRIPS 2          // Strips per thread, they are handed out as they finish
+
+// Polar rows sampled at reduced width, see MakePolarRows()
+#define POLARLEVELS 7         // Rows may be reduced across by 1, 2, 4 ... 64
+
 typedef struct {
 	int axis;
 	double value;
@@ -30,9 +62,66 @@ typedef struct {
    double x,y,z;
 } XYZ;
 
+// Supersample directions of the output image, see MakeRays()
+typedef struct {
+	int nlatitude,nlongitude;  // Supersample rows and columns
+	double *latitude,*coslatitude,*sinlatitude;
+	double *longitude,*coslongitude,*sinlongitude;
+	float *fcoslongitude,*fsinlongitude; // For ProjectRays()
+} RAYTABLE;
+
+// Reduction of each output row and how the full rows are interpolated
+typedef struct {
+	uint8_t *level;                // Reduction of each row as a power of 2, 0 for full width
+	int32_t *index[POLARLEVELS];   // Reduced pixel to the left of each column, see ExpandRow()
+	uint16_t *weight[POLARLEVELS]; // Weight of the one to its right, FRACONE is 1
+} POLARROWS;
+
+// Column spans of the output image by the cameras sampled there, see MakeZones()
+#define ZONEFRONT   0              // Camera 0 only, the zone is the camera number
+#define ZONEBACK    1              // Camera 1 only
+#define ZONEOVERLAP 2              // Both, blended
 typedef struct {
-	int index;
-} UV;
+	int start,stop;                // Pixel columns start to stop-1
+	int zone;
+} ZONESPAN;
+typedef struct {
+	int nspan[POLARLEVELS];        // Spans of the rows at each reduction
+	ZONESPAN *span[POLARLEVELS];
+} ZONES;
+
+// Vectorised projection, see ProjectRays()
+#ifndef VECSIZE
+#define VECSIZE 8                  // Rays per vector, set for each instruction set in the Makefile
+#endif
+#define PROJECTIONERROR 0.01       // Stated largest error in source pixels
+typedef float VFLOAT __attribute__ ((vector_size (VECSIZE*sizeof(float))));
+typedef int32_t VINT __attribute__ ((vector_size (VECSIZE*sizeof(int32_t))));
+
+// Batch lookup table, struct of arrays
+// For each output pixel the samples from camera 0 are followed by those from camera 1,
+// offsets index the two fisheye images stored one after the other
+// Samples are ordered by output tile, then raster order within the tile, so the
+// source pixels gathered for one tile are a compact patch that stays in cache
+#ifndef TILEWIDTH
+#define TILEWIDTH  64         // Output tile size, clamped to the output image
+#endif
+#ifndef TILEHEIGHT
+#define TILEHEIGHT 64
+#endif
+typedef struct {
+	int npixel;
+	uint64_t nsample;
+	int tilewidth,tileheight;
+	int ntilex,ntiley,ntile;
+	uint64_t *tilestart;       // First sample of each tile, ntile+1 entries
+	uint8_t *count[2];         // Samples per output pixel from each camera
+	uint32_t *offset;          // Source pixel of each sample
+	uint16_t *weight;          // Blend and antialias weight of each sample, WEIGHTONE is 1
+	uint16_t *frac;            // Sub pixel position of each sample, filtered sampling only
+	int filter;                // NEAREST, BILINEAR or BICUBIC
+	int stride;                // Fisheye frame width
+} LLTABLE;
 
 typedef struct {
 	char fname[256];
@@ -41,14 +130,21 @@ typedef struct {
    int centerx,centery;
    int radius;
 	int hflip,vflip;
+	int scale;                 // Decoded at 1/scale size, CENTER and RADIUS are full size
    double fov;
    TRANSFORM *transform;
    int ntransform;
+	double rotate[3][3];       // The transforms composed into one rotation, see MakeRotation()
 } FISHEYE;
 
 typedef struct {
 	int debug;
 	int antialias;             // Super sampling antialiasing
+	int adaptive;              // Batch table samples each pixel according to its source footprint, up to antialias
+	int mip;                   // Batch source pyramid levels below full size, 0 for none
+	int ewa;                   // Batch table uses elliptical weighted average taps instead of supersamples
+	int decodescale;           // Batch frames may be decoded at reduced size, see DecodeScale()
+	double polar;              // Rows further than this from the equator may be reduced across, 0 for off
 	double blendmid;           // Blending midpoint
 	double blendwidth;         // Width of blending, angle
 	double blendpower;         // For S curve blending
@@ -59,8 +155,22 @@ typedef struct {
                               // Should map from 0 to 1 to 0 to generally 1+delta
 
 	int makeremap;             // Create remap filters for ffmpeg (just fish2sphere mapping)
+	int verify;                // Check the projection kernel and exit
 
 	int fileformat;            // Input image format
+	int quality;               // JPEG output quality, 1 to 100
+	int subsample;             // JPEG output chroma subsampling, JPEG_SUB444, JPEG_SUB422 or JPEG_SUB420
+	int dctmethod;             // JPEG output DCT, JDCT_ISLOW, JDCT_IFAST or JDCT_FLOAT
+	int nthreads;              // Worker threads for batch rendering
+	double meshtolerance;      // Batch mesh remap error in source pixels, 0 for a lookup table
+	int lazytable;             // Build the lookup table while the first frame is rendered
+	int verifytable;           // Check the payload checksum of a cached lookup table
+	int filter;                // Source sampling, NEAREST, BILINEAR or BICUBIC
+	int benchmark;             // Time each kernel variant and the encoder this many times on the first frame
+	char kernel[32];           // Kernel variant to use, empty for the best the CPU supports
+
+	char cachedir[256];        // Where batch lookup tables are kept
+	double cachesize;          // Lookup table cache limit in MB, 0 for no limit
 
 	// For experimental optimisations
 	double deltafov;           // Variation of fov
@@ -69,6 +179,125 @@ typedef struct {
 } PARAMS;
 
 
+// Lookup table tiles built by the worker threads, concatenated afterwards
+typedef struct {
+	uint64_t nsample;
+	uint32_t *offset;
+	uint16_t *weight;
+	uint16_t *frac;
+} LUTTILE;
+
+// Kernel variants, see SelectKernels()
+#define MAXKERNEL 4
+typedef struct {
+	char *name;
+	void (*projectrays)(int,int,int,int,float *,float *);
+	void (*rendertile)(LLTABLE *,int,LUTTILE *,BITMAP4 *,BITMAP4 *);
+	void (*reducerow)(BITMAP4 *,BITMAP4 *,BITMAP4 *,int);
+	void (*expandrow)(BITMAP4 *,int32_t *,uint16_t *,BITMAP4 *,int);
+} KERNEL;
+
+#define TILEFREE 0
+#define TILEBUSY 1
+#define TILEDONE 2
+typedef struct {
+	LLTABLE *table;
+	int width,height;          // Fisheye frame size
+	LUTTILE *tile;
+	int failed;
+
+	// Lazy build, tiles are claimed by the background builder or by the first render
+	uint8_t *state;            // TILEFREE, TILEBUSY or TILEDONE for each tile
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_t builder,saver;
+	int building,saving;       // Those threads are running
+	int rendering;             // Render has started, the background builder stops
+	char *fname;               // Where the finished table is saved in the background
+	LUTHEADER *header;
+} BUILDJOB;
+
+// Mesh remap, fisheye coordinates interpolated across cells of the output image
+#define MESHSIZE  16          // Output pixels along the side of a coarse cell, power of 2
+#define MESHFAR   1           // Cell maps well outside a camera's image
+#define MESHEXACT 2           // Interpolation not accurate enough, evaluate every sample
+
+typedef struct {
+	float u[2],v[2];           // Fisheye coordinates for each camera
+} MESHNODE;
+
+typedef struct {
+	uint16_t x,y;              // Top left output pixel
+	uint16_t size;             // Output pixels along each side
+	uint8_t flag[2];           // MESHFAR or MESHEXACT for each camera
+	MESHNODE corner[4];        // (x,y), (x+size,y), (x,y+size), (x+size,y+size)
+} MESHCELL;
+
+typedef struct {
+	int width,height;          // Fisheye frame size
+	double rmax[2];            // Furthest image corner from the fisheye center, in radii
+	int *total[2];             // Camera weight of each column, WEIGHTONE is 1
+	uint8_t *inrange[2];       // Each supersample column in a camera's blend range
+	int nrow;                  // Rows of coarse cells
+	int *rowstart;             // First cell of each coarse row, nrow+1 entries
+	int ncell;
+	MESHCELL *cell;
+} MESH;
+
+// Cells of each coarse row built by the worker threads, concatenated afterwards
+typedef struct {
+	int ncell,nalloc;
+	MESHCELL *cell;
+} MESHROW;
+typedef struct {
+	MESH *mesh;
+	MESHROW *row;
+	int failed;
+} MESHJOB;
+
+// State shared by the threads rendering one frame from the lookup table or mesh
+typedef struct {
+	LLTABLE *table;
+	BUILDJOB *build;           // Lazy build in progress, tiles are in its buffers
+	MESH *mesh;
+	BITMAP4 *source;           // Fisheye pair
+	BITMAP4 *out;
+} RENDERJOB;
+
+// Source pyramid level being formed from the one above by the worker threads
+typedef struct {
+	BITMAP4 *image;            // Fisheye pair and its pyramid
+	int width,height;          // Fisheye frame size
+	int level;
+} PYRAMIDJOB;
+
+// Bands of rows handed out to worker threads
+typedef struct {
+	int nrows,chunk,next;
+	pthread_mutex_t lock;
+	void (*fn)(void *,int,int);
+	void *arg;
+} PARALLELROWS;
+
+// A pair of batch frames, decoded in the background while the one before is rendered
+typedef struct {
+	BITMAP4 *image;            // Both fisheyes and room for the pyramid, as fisheye[0].image
+	char fname[2][256];
+	int ok[2];                 // Each camera decoded
+	JPEGDECODER **decoder;     // One for each camera, used by one pair at a time
+	pthread_t thread;
+	int running;               // Being decoded by thread
+} FRAMEJOB;
+
+// Output image encoded in strips of rows, joined by JPEG_JoinStrips()
+typedef struct {
+	JPEGENCODER **strip;       // One encoder for each strip
+	int nstrip,rows;           // Rows in each strip, the last may be shorter
+	int width,height;
+	BITMAP4 *image;            // Being encoded
+	char *error;               // Reason for a failure
+} STRIPENCODER;
+
 typedef struct {
    int width,height;
    int sidewidth;
@@ -88,7 +317,9 @@ typedef struct {
 void GiveUsage(char *);
 void InitFisheye(FISHEYE *);
 void FisheyeDefaults(FISHEYE *);
-int FindFishPixel(int,double,double,int *,int *,COLOUR *);
+void MakeRotation(FISHEYE *);
+int FindFishPixel(int,int,int,int *,int *,COLOUR *);
+int FishPixel(int,double,double,int *,int *,COLOUR *);
 double GetTime(void);
 void DumpParameters(void);
 int ReadParameters(char *);
@@ -98,10 +329,90 @@ void MakeRandomRotations(void);
 COLOUR HSV2RGB(HSV);
 HSV RGB2HSV(COLOUR);
 void InitParams(void);
-void FlipFisheye(FISHEYE);
 XYZ RotateX(XYZ,double);
 XYZ RotateY(XYZ,double);
 XYZ RotateZ(XYZ,double);
 int CheckTemplate(char *,int);
 int CheckFrames(char *,char *,int *,int *);
 void MakeRemap(void);
+uint64_t TableHash(void);
+int InBlendRange(int,double);
+int MakeRays(void);
+void FreeRays(void);
+void SampleRay(int,int,int,XYZ *);
+void RayFishCoord(int,XYZ,double *,double *);
+void FishGeometry(int,double *,double *,double *);
+int DecodeScale(int,int);
+void FishCoord(int,double,double,double *,double *);
+void ProjectRays(int,int,int,int,float *,float *);
+void ProjectRaysAVX2(int,int,int,int,float *,float *);
+void ProjectRaysAVX512(int,int,int,int,float *,float *);
+int VerifyProjection(void);
+int FishOffset(int,int,double,double,uint32_t *,uint16_t *,int,int);
+int LevelRow(int,int);
+int MipLevel(float *,float *,int,int,int,double,double);
+int EWATaps(int,float *,float *,int,int,int,int,int,int,int,int,uint32_t *,uint16_t *);
+void ReduceRow(BITMAP4 *,BITMAP4 *,BITMAP4 *,int);
+void ReduceRowAVX2(BITMAP4 *,BITMAP4 *,BITMAP4 *,int);
+void ReducePyramidRows(void *,int,int);
+void MakePyramid(BITMAP4 *,int,int,int);
+int MakePolarRows(void);
+int PolarColumn(int,int);
+void FreePolarRows(void);
+void ExpandRow(BITMAP4 *,int32_t *,uint16_t *,BITMAP4 *,int);
+void ExpandRowAVX2(BITMAP4 *,int32_t *,uint16_t *,BITMAP4 *,int);
+void ExpandPolarRow(BITMAP4 *,BITMAP4 *,int);
+int MakeZones(int);
+void RenderCameraSpan(int,ZONESPAN *,int,float *,float *,BITMAP4 *);
+void AdaptiveSamples(float *,float *,int,int,int,int *,int *);
+void MakeFilter(void);
+void FilterSample(BITMAP4 *,uint32_t,uint16_t,int,int,uint32_t *);
+double BlendWeight(double);
+void LookupTiles(LLTABLE *,int,int);
+void TileBounds(LLTABLE *,int,int *,int *,int *,int *);
+void BuildLookupTiles(void *,int,int);
+int InitLookupTable(LLTABLE *,BUILDJOB *,int,int);
+int ConcatLookupTable(BUILDJOB *,LLTABLE *,int);
+int BuildLookupTable(LLTABLE *,int,int);
+void LookupTile(BUILDJOB *,int);
+void BuildLazyTiles(void *,int,int);
+void *LazyBuilder(void *);
+int StartLookupTable(BUILDJOB *,LLTABLE *,int,int);
+int FinishLookupTable(BUILDJOB *);
+void *SaveLookupThread(void *);
+void FreeLazyTable(BUILDJOB *);
+void FreeLookupTable(LLTABLE *);
+int MapLookupTable(LUTFILE *,LLTABLE *);
+int SaveLookupTable(char *,LUTHEADER *,LLTABLE *);
+void TableFootprint(LLTABLE *,double *,double *);
+void RenderTile(LLTABLE *,int,LUTTILE *,BITMAP4 *,BITMAP4 *);
+void RenderTileAVX2(LLTABLE *,int,LUTTILE *,BITMAP4 *,BITMAP4 *);
+void RenderFilteredTile(LLTABLE *,int,LUTTILE *,BITMAP4 *,BITMAP4 *);
+void RenderLookupTiles(void *,int,int);
+void RenderPolarTiles(void *,int,int);
+void RenderLookupTable(LLTABLE *,BUILDJOB *,BITMAP4 *,BITMAP4 *);
+int SelectKernels(char *);
+void LimitKernels(uint64_t);
+void BenchmarkKernels(LLTABLE *,BUILDJOB *,BITMAP4 *,BITMAP4 *);
+void MeshNode(double,double,MESHNODE *);
+int MeshAddCell(MESHROW *,MESHCELL *);
+int MeshSplit(MESH *,MESHROW *,int,int,int,MESHNODE *);
+void BuildMeshRows(void *,int,int);
+int BuildMesh(MESH *,int,int);
+void FreeMesh(MESH *);
+void RenderMeshRows(void *,int,int);
+void RenderMesh(MESH *,BITMAP4 *,BITMAP4 *);
+void *ParallelRowsWorker(void *);
+void ParallelRows(int,int,void (*)(void *,int,int),void *);
+int readJPGFast(FISHEYE *,char *,BITMAP4 *,JPEGDECODER *);
+int readJPG(FISHEYE *);
+void ReadFrames(void *,int,int);
+void DecodeFrames(void *,int,int);
+void *DecodeFramesThread(void *);
+void StartFrames(FRAMEJOB *,char *,char *,int);
+int FinishFrames(FRAMEJOB *);
+int NewStripEncoder(STRIPENCODER *,int,int,int);
+void EncodeStrips(void *,int,int);
+int EncodeOutput(STRIPENCODER *,FILE *,BITMAP4 *);
+void FreeStripEncoder(STRIPENCODER *);
+void BenchmarkEncoder(STRIPENCODER *,BITMAP4 *);
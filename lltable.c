@@ -0,0 +1,344 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include "lltable.h"
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+#define LUT_SEED  0xcbf29ce484222325ULL
+#define LUT_PRIME 0x100000001b3ULL
+
+/*
+	Clear a header, fields not filled in by the caller compare as zero
+*/
+void LUT_InitHeader(LUTHEADER *h)
+{
+	memset(h,0,sizeof(LUTHEADER));
+}
+
+/*
+	64 bit hash, FNV style but consuming 8 bytes at a time in 4 independent
+	lanes so checksumming a few hundred MB is limited by memory bandwidth.
+	Pass the previous result as the seed to hash a sequence of buffers,
+	pass 0 to start a new one.
+*/
+uint64_t LUT_Hash(const void *data,size_t n,uint64_t seed)
+{
+	const unsigned char *p = data;
+	uint64_t w[4],h[4];
+	size_t i = 0;
+	int k;
+
+	if (seed == 0)
+		seed = LUT_SEED;
+	for (k=0;k<4;k++)
+		h[k] = seed + k;
+
+	for (i=0;i+32<=n;i+=32) {
+		memcpy(w,p+i,32);
+		for (k=0;k<4;k++) {
+			h[k] = (h[k] ^ w[k]) * LUT_PRIME;
+			h[k] ^= h[k] >> 32;
+		}
+	}
+	for (;i<n;i++)
+		h[0] = (h[0] ^ p[i]) * LUT_PRIME;
+
+	// Fold the lanes
+	for (k=1;k<4;k++)
+		h[0] = (h[0] ^ h[k]) * LUT_PRIME;
+	h[0] ^= h[0] >> 29;
+	if (h[0] == 0) // 0 is reserved for "start"
+		h[0] = 1;
+
+	return(h[0]);
+}
+
+/*
+	Map a lookup table file read only and check it against the expected header
+	Return FALSE if the file does not exist or is stale, truncated or corrupt,
+	in which case the caller should rebuild it.
+	The header and section bounds are always checked, they cost nothing. The
+	payload checksum is only verified if verify is set, it reads every page of
+	the table, which is what mapping it avoids. Tables are renamed into place
+	complete, see LUT_Write(), so a torn table is not expected.
+*/
+int LUT_Open(char *fname,LUTHEADER *expect,LUTFILE *lut,int verify)
+{
+	int fd,i;
+	struct stat st;
+	LUTHEADER *h;
+	uint64_t checksum = 0;
+	char *reason = NULL;
+
+	memset(lut,0,sizeof(LUTFILE));
+
+	if ((fd = open(fname,O_RDONLY)) < 0) {
+		if (errno != ENOENT)
+			fprintf(stderr,"LUT_Open() - Failed to open lookup table \"%s\"\n",fname);
+		return(FALSE);
+	}
+	if (fstat(fd,&st) != 0 || st.st_size < (off_t)sizeof(LUTHEADER)) {
+		fprintf(stderr,"LUT_Open() - Lookup table \"%s\" is truncated\n",fname);
+		close(fd);
+		return(FALSE);
+	}
+	lut->size = st.st_size;
+	lut->base = mmap(NULL,lut->size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if (lut->base == MAP_FAILED) {
+		fprintf(stderr,"LUT_Open() - Failed to map lookup table \"%s\"\n",fname);
+		lut->base = NULL;
+		return(FALSE);
+	}
+	h = &lut->header;
+	memcpy(h,lut->base,sizeof(LUTHEADER));
+
+	// Format
+	if (memcmp(h->magic,LUT_MAGIC,8) != 0)
+		reason = "not a lookup table";
+	else if (h->version != LUT_VERSION || h->headersize != sizeof(LUTHEADER))
+		reason = "wrong version";
+	else if (h->nsection > LUT_MAXSECTION)
+		reason = "corrupt header";
+
+	// Does it describe the mapping we want
+	else if (h->whichtemplate != expect->whichtemplate ||
+		h->srcwidth != expect->srcwidth || h->srcheight != expect->srcheight ||
+		h->outwidth != expect->outwidth || h->outheight != expect->outheight ||
+		h->antialias != expect->antialias || h->paramhash != expect->paramhash ||
+		h->tilewidth != expect->tilewidth || h->tileheight != expect->tileheight ||
+		h->filter != expect->filter || h->adaptive != expect->adaptive || h->mip != expect->mip ||
+		h->ewa != expect->ewa)
+		reason = "stale, built for different parameters";
+
+	// Sections must lie within the file
+	for (i=0;reason == NULL && i<h->nsection;i++) {
+		if (h->section[i].offset % LUT_ALIGN != 0 || h->section[i].offset > lut->size ||
+			h->section[i].size > lut->size - h->section[i].offset)
+			reason = "truncated";
+		else
+			lut->section[i] = (char *)lut->base + h->section[i].offset;
+	}
+
+	// Payload integrity, optional
+	for (i=0;verify && reason == NULL && i<h->nsection;i++)
+		checksum = LUT_Hash(lut->section[i],h->section[i].size,checksum);
+	if (verify && reason == NULL && checksum != h->checksum)
+		reason = "checksum mismatch";
+
+	if (reason != NULL) {
+		fprintf(stderr,"LUT_Open() - Rejecting lookup table \"%s\", %s\n",fname,reason);
+		LUT_Close(lut);
+		return(FALSE);
+	}
+
+	return(TRUE);
+}
+
+/*
+	Unmap a table opened with LUT_Open()
+*/
+void LUT_Close(LUTFILE *lut)
+{
+	if (lut->base != NULL)
+		munmap(lut->base,lut->size);
+	memset(lut,0,sizeof(LUTFILE));
+}
+
+/*
+	Write the header followed by the page aligned payload sections
+	The caller fills in the descriptive fields of the header, the format
+	fields, section table and checksum are filled in here.
+	The table is written to a temporary file and renamed into place, so a
+	concurrent reader sees either no table or a complete one.
+*/
+int LUT_Write(char *fname,LUTHEADER *h,void **data,uint64_t *size,int nsection)
+{
+	int i;
+	uint64_t offset;
+	char tmpname[300];
+	FILE *fptr;
+	static char zero[LUT_ALIGN];
+
+	if (nsection > LUT_MAXSECTION)
+		return(FALSE);
+
+	memcpy(h->magic,LUT_MAGIC,8);
+	h->version = LUT_VERSION;
+	h->headersize = sizeof(LUTHEADER);
+	h->nsection = nsection;
+	h->checksum = 0;
+	offset = LUT_ALIGN;
+	for (i=0;i<nsection;i++) {
+		h->section[i].offset = offset;
+		h->section[i].size = size[i];
+		offset += (size[i] + LUT_ALIGN - 1) / LUT_ALIGN * LUT_ALIGN;
+		h->checksum = LUT_Hash(data[i],size[i],h->checksum);
+	}
+
+	sprintf(tmpname,"%s.%d.tmp",fname,(int)getpid());
+	if ((fptr = fopen(tmpname,"wb")) == NULL) {
+		fprintf(stderr,"LUT_Write() - Failed to create lookup table \"%s\"\n",tmpname);
+		return(FALSE);
+	}
+	if (fwrite(h,sizeof(LUTHEADER),1,fptr) != 1)
+		goto failed;
+	offset = sizeof(LUTHEADER);
+	for (i=0;i<nsection;i++) {
+		if (fwrite(zero,1,h->section[i].offset-offset,fptr) != h->section[i].offset-offset)
+			goto failed;
+		if (fwrite(data[i],1,size[i],fptr) != size[i])
+			goto failed;
+		offset = h->section[i].offset + size[i];
+	}
+	if (fclose(fptr) != 0) {
+		fptr = NULL;
+		goto failed;
+	}
+	fptr = NULL;
+	if (rename(tmpname,fname) != 0)
+		goto failed;
+	return(TRUE);
+
+failed:
+	fprintf(stderr,"LUT_Write() - Failed to write lookup table \"%s\"\n",fname);
+	if (fptr != NULL)
+		fclose(fptr);
+	remove(tmpname);
+	return(FALSE);
+}
+
+/*
+	Cache key, covers the table format and every field that describes the mapping
+*/
+uint64_t LUT_Key(LUTHEADER *h)
+{
+	uint64_t key = 0;
+	uint32_t version = LUT_VERSION;
+
+	key = LUT_Hash(&version,sizeof(uint32_t),key);
+	key = LUT_Hash(&h->whichtemplate,sizeof(int32_t),key);
+	key = LUT_Hash(&h->srcwidth,sizeof(int32_t),key);
+	key = LUT_Hash(&h->srcheight,sizeof(int32_t),key);
+	key = LUT_Hash(&h->outwidth,sizeof(int32_t),key);
+	key = LUT_Hash(&h->outheight,sizeof(int32_t),key);
+	key = LUT_Hash(&h->antialias,sizeof(int32_t),key);
+	key = LUT_Hash(&h->tilewidth,sizeof(int32_t),key);
+	key = LUT_Hash(&h->tileheight,sizeof(int32_t),key);
+	key = LUT_Hash(&h->filter,sizeof(int32_t),key);
+	key = LUT_Hash(&h->adaptive,sizeof(int32_t),key);
+	key = LUT_Hash(&h->mip,sizeof(int32_t),key);
+	key = LUT_Hash(&h->ewa,sizeof(int32_t),key);
+	key = LUT_Hash(&h->paramhash,sizeof(uint64_t),key);
+
+	return(key);
+}
+
+/*
+	Form the file name of a table in the cache directory, creating the
+	directory if required. Return FALSE if the directory is not usable.
+*/
+int LUT_CacheName(char *dir,LUTHEADER *h,char *fname)
+{
+	struct stat st;
+
+	if (strlen(dir) > 200) {
+		fprintf(stderr,"LUT_CacheName() - Cache directory name too long\n");
+		return(FALSE);
+	}
+	if (stat(dir,&st) != 0) {
+		if (mkdir(dir,0755) != 0 && errno != EEXIST) {
+			fprintf(stderr,"LUT_CacheName() - Failed to create cache directory \"%s\"\n",dir);
+			return(FALSE);
+		}
+	} else if (!S_ISDIR(st.st_mode)) {
+		fprintf(stderr,"LUT_CacheName() - \"%s\" is not a directory\n",dir);
+		return(FALSE);
+	}
+	sprintf(fname,"%s/%s%016llx%s",dir,LUT_CACHEPREFIX,(unsigned long long)LUT_Key(h),LUT_CACHESUFFIX);
+
+	return(TRUE);
+}
+
+/*
+	Mark a table as recently used, the modification time is the LRU stamp
+*/
+void LUT_CacheTouch(char *fname)
+{
+	utimes(fname,NULL);
+}
+
+typedef struct {
+	char name[300];
+	time_t stamp;
+	uint64_t size;
+} LUTCACHEENTRY;
+
+static int LUT_CacheCompare(const void *a,const void *b)
+{
+	const LUTCACHEENTRY *e1 = a,*e2 = b;
+
+	if (e1->stamp < e2->stamp)
+		return(-1);
+	if (e1->stamp > e2->stamp)
+		return(1);
+	return(strcmp(e1->name,e2->name));
+}
+
+/*
+	Remove least recently used tables until the cache is no larger than maxsize bytes
+	The table named keep, normally the one just written, is never removed.
+	maxsize of 0 means no limit.
+*/
+void LUT_CacheEvict(char *dir,uint64_t maxsize,char *keep)
+{
+	int i,n = 0,nalloc = 0;
+	size_t lp = strlen(LUT_CACHEPREFIX),ls = strlen(LUT_CACHESUFFIX),l;
+	uint64_t total = 0;
+	DIR *d;
+	struct dirent *de;
+	struct stat st;
+	LUTCACHEENTRY *entry = NULL,*more;
+
+	if (maxsize == 0 || (d = opendir(dir)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		l = strlen(de->d_name);
+		if (l <= lp+ls || l > 200 || strncmp(de->d_name,LUT_CACHEPREFIX,lp) != 0 ||
+			strcmp(de->d_name+l-ls,LUT_CACHESUFFIX) != 0)
+			continue;
+		if (n >= nalloc) {
+			if ((more = realloc(entry,(nalloc+64)*sizeof(LUTCACHEENTRY))) == NULL)
+				break; // Evict from what has been found so far
+			entry = more;
+			nalloc += 64;
+		}
+		if (snprintf(entry[n].name,sizeof(entry[n].name),"%s/%s",dir,de->d_name) >= sizeof(entry[n].name))
+			continue;
+		if (stat(entry[n].name,&st) != 0)
+			continue;
+		entry[n].stamp = st.st_mtime;
+		entry[n].size = st.st_size;
+		total += st.st_size;
+		n++;
+	}
+	closedir(d);
+
+	// Oldest first
+	qsort(entry,n,sizeof(LUTCACHEENTRY),LUT_CacheCompare);
+	for (i=0;i<n && total > maxsize;i++) {
+		if (keep != NULL && strcmp(entry[i].name,keep) == 0)
+			continue;
+		if (remove(entry[i].name) == 0)
+			total -= entry[i].size;
+	}
+	free(entry);
+}
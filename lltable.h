@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+	On disk format of the batch lookup table
+	A fixed size header followed by payload sections, each section starts on a
+	LUT_ALIGN boundary so the file can be mapped read only and used in place.
+	Values are in native byte order, tables are not meant to move between machines.
+*/
+
+#define LUT_MAGIC      "F2SLUT\r\n"
+#define LUT_VERSION    7
+#define LUT_ALIGN      4096
+#define LUT_MAXSECTION 8
+
+typedef struct {
+	uint64_t offset;              // Bytes from start of file, multiple of LUT_ALIGN
+	uint64_t size;                // Bytes
+} LUTSECTION;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t headersize;          // sizeof(LUTHEADER), catches layout changes
+	int32_t whichtemplate;
+	int32_t srcwidth,srcheight;   // Fisheye frame size
+	int32_t outwidth,outheight;   // Equirectangular size
+	int32_t antialias;
+	int32_t tilewidth,tileheight; // Output tile size, samples are stored tile by tile
+	int32_t filter;               // Source sampling, 0 nearest, otherwise sub pixel positions are stored
+	int32_t adaptive;             // Samples per pixel chosen from the source footprint, antialias is the most
+	int32_t mip;                  // Source pyramid levels below full size the samples may come from
+	int32_t ewa;                  // Elliptical weighted average taps instead of supersamples
+	uint64_t paramhash;           // Hash of everything that affects the mapping
+	uint64_t checksum;            // Hash of all payload sections
+	uint64_t nentry;              // Number of samples
+	uint32_t nsection;
+	uint32_t reserved;
+	LUTSECTION section[LUT_MAXSECTION];
+} LUTHEADER;
+
+typedef struct {
+	LUTHEADER header;
+	void *base;                   // Mapped file
+	size_t size;
+	void *section[LUT_MAXSECTION];
+} LUTFILE;
+
+// Cached tables are named by their key, f2s_<key>.lut
+#define LUT_CACHEPREFIX "f2s_"
+#define LUT_CACHESUFFIX ".lut"
+
+// Prototypes
+void LUT_InitHeader(LUTHEADER *);
+uint64_t LUT_Hash(const void *,size_t,uint64_t);
+int LUT_Open(char *,LUTHEADER *,LUTFILE *,int);
+void LUT_Close(LUTFILE *);
+int LUT_Write(char *,LUTHEADER *,void **,uint64_t *,int);
+uint64_t LUT_Key(LUTHEADER *);
+int LUT_CacheName(char *,LUTHEADER *,char *);
+void LUT_CacheTouch(char *);
+void LUT_CacheEvict(char *,uint64_t,char *);
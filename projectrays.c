@@ -0,0 +1,91 @@
+#include "fusion2sphere.h"
+
+/*
+	Projection kernel for the table build, compiled once for each instruction
+	set with PROJECTRAYS naming the variant and VECSIZE the rays per vector,
+	see SelectKernels(). Floating point contraction is turned off so every
+	variant gives the same coordinates and the same lookup table.
+*/
+
+#ifndef PROJECTRAYS
+#define PROJECTRAYS ProjectRays
+#endif
+
+extern FISHEYE fisheye[2];
+extern RAYTABLE rays;
+
+/*
+	Vectorised projection of a run of supersample rays onto fisheye n
+	Rays are along supersample row js from column is0, count of them, the
+	fractional fisheye coordinates are written to u[] and v[].
+	This is RayFishCoord() in single precision, VECSIZE rays at a time, with
+	a polynomial atan2() and 1/sqrt() by Newton iteration so the whole kernel
+	is plain vector arithmetic. The coordinates agree with RayFishCoord() to
+	within PROJECTIONERROR source pixels, check with -V.
+*/
+#define VSELECT(mask,a,b) ((VFLOAT)(((VINT)(a) & (mask)) | ((VINT)(b) & ~(mask))))
+
+void PROJECTRAYS(int n,int js,int is0,int count,float *u,float *v)
+{
+	int k,l,nk;
+	float *coslon = rays.fcoslongitude + is0,*sinlon = rays.fsinlongitude + is0;
+	float sign = (n == 1) ? -1 : 1; // Turned by 180 degrees for the second fisheye
+	float cl = sign * rays.coslatitude[js],sl = rays.sinlatitude[js];
+	float m[3][3],scale,cx,cy;
+	double x,y,r;
+	VFLOAT c = {0},s = {0},px,py,pz,qx,qy,qz,rho2,rinv,ay,num,den,t,z,phi;
+	VINT swap;
+
+	for (k=0;k<3;k++)
+		for (l=0;l<3;l++)
+			m[k][l] = fisheye[n].rotate[k][l];
+	FishGeometry(n,&x,&y,&r);
+	scale = r / fisheye[n].fov;
+	cx = x;
+	cy = y;
+
+	for (k=0;k<count;k+=VECSIZE) {
+		nk = MIN(VECSIZE,count-k);
+		for (l=0;l<VECSIZE;l++) { // Partial last vector padded with a valid ray
+			c[l] = coslon[k + (l < nk ? l : 0)];
+			s[l] = sinlon[k + (l < nk ? l : 0)];
+		}
+
+		// Ray and fisheye correction
+		px = cl * s;
+		py = cl * c;
+		pz = sl + 0 * c;
+		qx = m[0][0] * px + m[0][1] * py + m[0][2] * pz;
+		qy = m[1][0] * px + m[1][1] * py + m[1][2] * pz;
+		qz = m[2][0] * px + m[2][1] * py + m[2][2] * pz;
+
+		// 1/rho, 3 Newton steps from the bit level estimate is full single precision
+		rho2 = qx * qx + qz * qz;
+		rinv = (VFLOAT)(0x5f3759df - ((VINT)rho2 >> 1));
+		rinv = rinv * (1.5f - 0.5f * rho2 * rinv * rinv);
+		rinv = rinv * (1.5f - 0.5f * rho2 * rinv * rinv);
+		rinv = rinv * (1.5f - 0.5f * rho2 * rinv * rinv);
+
+		// phi = atan2(rho,qy), reduced to atan() on 0 ... 1, Abramowitz and Stegun 4.4.49
+		ay = (VFLOAT)((VINT)qy & 0x7fffffff);
+		swap = rho2 * rinv > ay;
+		num = VSELECT(swap,ay,rho2 * rinv);
+		den = VSELECT(swap,rho2 * rinv,ay);
+		t = num / den;
+		z = t * t;
+		phi = t * (1.0f + z * (-0.3333314528f + z * (0.1999355085f + z * (-0.1420889944f +
+			z * (0.1065626393f + z * (-0.0752896400f + z * (0.0429096138f +
+			z * (-0.0161657367f + z * 0.0028662257f))))))));
+		phi = VSELECT(swap,(float)PID2 - phi,phi);
+		phi = VSELECT(qy < 0,(float)PI - phi,phi);
+
+		// r * (cos(theta),sin(theta)) = r * (x,z) / rho
+		t = scale * phi * rinv;
+		px = cx + t * qx;
+		pz = cy + t * qz;
+		for (l=0;l<nk;l++) {
+			u[k+l] = px[l];
+			v[k+l] = pz[l];
+		}
+	}
+}
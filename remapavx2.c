@@ -0,0 +1,190 @@
+#include "fusion2sphere.h"
+
+/*
+	Kernels using AVX2, this file is compiled with -mavx2 and its functions are
+	only called when the CPU supports it, see SelectKernels()
+	Without AVX2 support in the compiler the file is empty and the kernels are not offered
+*/
+
+#ifdef __AVX2__
+#include <immintrin.h>
+
+extern PARAMS params;
+
+/*
+	Weighted colour of 8 consecutive lookup table samples, the source pixels are
+	fetched with one gather of the packed 32 bit BITMAP4 values
+*/
+static inline void WeighSamples(uint32_t *offset,uint16_t *weight,BITMAP4 *source,__m256i *r,__m256i *g,__m256i *b)
+{
+	const __m256i lowbyte = _mm256_set1_epi32(0xff);
+	__m256i off,w,p;
+
+	off = _mm256_loadu_si256((__m256i *)offset);
+	w = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)weight));
+	p = _mm256_i32gather_epi32((const int *)source,off,4);
+	*r = _mm256_mullo_epi32(w,_mm256_and_si256(p,lowbyte));
+	*g = _mm256_mullo_epi32(w,_mm256_and_si256(_mm256_srli_epi32(p,8),lowbyte));
+	*b = _mm256_mullo_epi32(w,_mm256_and_si256(_mm256_srli_epi32(p,16),lowbyte));
+}
+
+/*
+	Add up runs of n consecutive values across the n vectors in v, n is 2, 4 or 8
+	Run k of the 8 runs ends up in lane k of the result
+*/
+static inline __m256i SumRuns(__m256i *v,int n)
+{
+	__m256i a,b;
+
+	switch (n) {
+	case 2: // Lanes come out as runs 0,1,4,5 | 2,3,6,7
+		a = _mm256_hadd_epi32(v[0],v[1]);
+		return(_mm256_permutevar8x32_epi32(a,_mm256_setr_epi32(0,1,4,5,2,3,6,7)));
+	case 4: // 0,2,4,6 | 1,3,5,7
+		a = _mm256_hadd_epi32(_mm256_hadd_epi32(v[0],v[1]),_mm256_hadd_epi32(v[2],v[3]));
+		return(_mm256_permutevar8x32_epi32(a,_mm256_setr_epi32(0,4,1,5,2,6,3,7)));
+	default: // Each half holds half of each of 4 runs
+		a = _mm256_hadd_epi32(_mm256_hadd_epi32(v[0],v[1]),_mm256_hadd_epi32(v[2],v[3]));
+		b = _mm256_hadd_epi32(_mm256_hadd_epi32(v[4],v[5]),_mm256_hadd_epi32(v[6],v[7]));
+		return(_mm256_add_epi32(_mm256_permute2x128_si256(a,b,0x20),_mm256_permute2x128_si256(a,b,0x31)));
+	}
+}
+
+/*
+	RenderTile() for 8 output pixels at a time
+	Where the 8 pixels have the same number of samples, 1, 2, 4 or 8, which is
+	most of the image at -a 1 and -a 2, their samples are weighed 8 at a time and
+	the runs belonging to each pixel added up across the vectors. Groups with
+	none, the unused ends of reduced rows, are stored as black. Other groups
+	are done as RenderTile(). The integer arithmetic is the same, so the result is identical.
+*/
+void RenderTileAVX2(LLTABLE *table,int t,LUTTILE *tile,BITMAP4 *source,BITMAP4 *out)
+{
+	int i0,i1,j0,j1,j,k,m,index,index1,group,nsample,uniform;
+	uint32_t r,g,b,w,*offset = tile->offset;
+	uint16_t *weight = tile->weight;
+	__m256i vr[8],vg[8],vb[8],p;
+
+	TileBounds(table,t,&i0,&i1,&j0,&j1);
+	for (j=j0;j<j1;j++) {
+		index1 = j * params.outwidth + i1;
+		for (index=j*params.outwidth+i0;index<index1;index=group) {
+
+			// Next 8 pixels if they have the same number of samples, 0, 1, 2, 4 or 8
+			group = MIN(index+8,index1);
+			nsample = table->count[0][index] + table->count[1][index];
+			uniform = (group - index == 8 && (nsample <= 2 || nsample == 4 || nsample == 8));
+			for (k=index+1;k<group && uniform;k++)
+				uniform = (table->count[0][k] + table->count[1][k] == nsample);
+
+			if (uniform) {
+				vr[0] = _mm256_setzero_si256();
+				vg[0] = vr[0];
+				vb[0] = vr[0];
+				for (m=0;m<nsample;m++)
+					WeighSamples(offset+8*m,weight+8*m,source,&vr[m],&vg[m],&vb[m]);
+				if (nsample > 1) {
+					vr[0] = SumRuns(vr,nsample);
+					vg[0] = SumRuns(vg,nsample);
+					vb[0] = SumRuns(vb,nsample);
+				}
+
+				// Back to 8 bits and repack as BITMAP4 with alpha 255
+				p = _mm256_or_si256(_mm256_srli_epi32(vr[0],WEIGHTBITS),
+					_mm256_slli_epi32(_mm256_srli_epi32(vg[0],WEIGHTBITS),8));
+				p = _mm256_or_si256(p,_mm256_slli_epi32(_mm256_srli_epi32(vb[0],WEIGHTBITS),16));
+				p = _mm256_or_si256(p,_mm256_set1_epi32(0xff000000));
+				_mm256_storeu_si256((__m256i *)(out+index),p);
+				offset += 8 * nsample;
+				weight += 8 * nsample;
+				continue;
+			}
+
+			for (;index<group;index++) {
+				nsample = table->count[0][index] + table->count[1][index];
+				r = 0;
+				g = 0;
+				b = 0;
+				for (k=0;k<nsample;k++) {
+					w = weight[k];
+					r += w * source[offset[k]].r;
+					g += w * source[offset[k]].g;
+					b += w * source[offset[k]].b;
+				}
+				offset += nsample;
+				weight += nsample;
+				out[index].r = r >> WEIGHTBITS;
+				out[index].g = g >> WEIGHTBITS;
+				out[index].b = b >> WEIGHTBITS;
+				out[index].a = 255;
+			}
+		}
+	}
+}
+
+/*
+	Sums of the 2x2 blocks of 8 pixels across two rows, as 16 bit channels
+	Each 128 bit lane holds two blocks, pixels 0 to 3 in the low lane
+*/
+static inline __m256i BlockSums(__m256i a,__m256i b)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo,hi;
+
+	lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a,zero),_mm256_unpacklo_epi8(b,zero));
+	hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a,zero),_mm256_unpackhi_epi8(b,zero));
+	lo = _mm256_add_epi16(lo,_mm256_srli_si256(lo,8));
+	hi = _mm256_add_epi16(hi,_mm256_srli_si256(hi,8));
+	return(_mm256_unpacklo_epi64(lo,hi));
+}
+
+/*
+	ReduceRow() 8 output pixels at a time, with the same rounding
+*/
+void ReduceRowAVX2(BITMAP4 *row0,BITMAP4 *row1,BITMAP4 *out,int n)
+{
+	int i;
+	const __m256i two = _mm256_set1_epi16(2);
+	__m256i s0,s1;
+
+	for (i=0;i+8<=n;i+=8) {
+		s0 = BlockSums(_mm256_loadu_si256((__m256i *)(row0+2*i)),_mm256_loadu_si256((__m256i *)(row1+2*i)));
+		s1 = BlockSums(_mm256_loadu_si256((__m256i *)(row0+2*i+8)),_mm256_loadu_si256((__m256i *)(row1+2*i+8)));
+		s0 = _mm256_srli_epi16(_mm256_add_epi16(s0,two),2);
+		s1 = _mm256_srli_epi16(_mm256_add_epi16(s1,two),2);
+		s0 = _mm256_permute4x64_epi64(_mm256_packus_epi16(s0,s1),_MM_SHUFFLE(3,1,2,0));
+		_mm256_storeu_si256((__m256i *)(out+i),s0);
+	}
+	ReduceRow(row0+2*i,row1+2*i,out+i,n-i);
+}
+
+/*
+	ExpandRow() 8 pixels at a time, both neighbours of each are gathered
+	The lanes are weighed as 16 bit values, the same arithmetic as ExpandRow()
+*/
+void ExpandRowAVX2(BITMAP4 *in,int32_t *index,uint16_t *weight,BITMAP4 *out,int n)
+{
+	int i;
+	const __m256i lanes = _mm256_set1_epi32(0xff00ff),half = _mm256_set1_epi32(0x800080);
+	const __m256i one = _mm256_set1_epi16(FRACONE);
+	__m256i idx,p0,p1,w0,w1,rb,ga;
+
+	for (i=0;i+8<=n;i+=8) {
+		idx = _mm256_loadu_si256((__m256i *)(index+i));
+		p0 = _mm256_i32gather_epi32((const int *)in,idx,4);
+		p1 = _mm256_i32gather_epi32((const int *)(in+1),idx,4);
+		w1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)(weight+i)));
+		w1 = _mm256_or_si256(w1,_mm256_slli_epi32(w1,16)); // In both 16 bit lanes
+		w0 = _mm256_sub_epi16(one,w1);
+		rb = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(p0,lanes),w0),
+			_mm256_mullo_epi16(_mm256_and_si256(p1,lanes),w1));
+		ga = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(p0,8),lanes),w0),
+			_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(p1,8),lanes),w1));
+		rb = _mm256_srli_epi16(_mm256_add_epi16(rb,half),FRACBITS);
+		ga = _mm256_srli_epi16(_mm256_add_epi16(ga,half),FRACBITS);
+		_mm256_storeu_si256((__m256i *)(out+i),_mm256_or_si256(rb,_mm256_slli_epi16(ga,8)));
+	}
+	ExpandRow(in,index+i,weight+i,out+i,n-i);
+}
+
+#endif